@@ -0,0 +1,126 @@
+/*
+ * FreeGuard: A Faster Secure Heap Allocator
+ * Copyright (C) 2017 Sam Silvestro, Hongyu Liu, Corey Crosser,
+ *                    Zhiqiang Lin, and Tongping Liu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * @file   arena.hh: regions whose objects are all released at once.
+ */
+#ifndef __ARENA_HH__
+#define __ARENA_HH__
+
+#include "bigheap.hh"
+#include "xdefines.hh"
+
+// An arena carves objects out of chunks taken from the big heap, each of
+// which ends at a guard page. Objects are never freed one by one: reset()
+// releases all chunks but one, which is reused, and destroy() releases them
+// all. Arenas are not thread-safe.
+class Arena {
+	// The header at the start of every chunk.
+	struct arenaChunk {
+		arenaChunk * next;
+	};
+
+public:
+	void initialize(size_t chunkSize) {
+		_chunkSize = (chunkSize == 0) ? ARENA_CHUNK_SIZE : alignup(chunkSize, PageSize);
+		_chunks = NULL;
+		_position = NULL;
+		_end = NULL;
+	}
+
+	// Returns NULL only if size is too large to be represented. Objects of size
+	// 0 still get a distinct address.
+	void * allocate(size_t size) {
+		size = (size == 0) ? ARENA_ALIGNMENT : alignup(size, ARENA_ALIGNMENT);
+		if(size <= (size_t)(_end - _position)) {
+			void * ptr = _position;
+			_position += size;
+			return ptr;
+		}
+
+		if(size > SIZE_MAX - PageSize - alignup(sizeof(arenaChunk), ARENA_ALIGNMENT)) {
+			return NULL;
+		}
+		// Objects taking more than a quarter of a chunk get a chunk of their own,
+		// so that the rest of the current chunk is not wasted.
+		size_t payloadSize = _chunkSize - alignup(sizeof(arenaChunk), ARENA_ALIGNMENT);
+		if(size > payloadSize / 4) {
+			return addChunk(alignup(size + alignup(sizeof(arenaChunk), ARENA_ALIGNMENT), PageSize), _end != NULL);
+		}
+
+		_position = addChunk(_chunkSize, false);
+		_end = _position + payloadSize;
+		void * ptr = _position;
+		_position += size;
+		return ptr;
+	}
+
+	// Releases every chunk but the current one, from which allocation starts
+	// over.
+	void reset() {
+		if(_end == NULL) {
+			destroy();
+			return;
+		}
+
+		arenaChunk * chunk = _chunks->next;
+		while(chunk != NULL) {
+			arenaChunk * next = chunk->next;
+			BigHeap::getInstance().deallocateToBigHeap(chunk);
+			chunk = next;
+		}
+		_chunks->next = NULL;
+		_position = (char *)_chunks + alignup(sizeof(arenaChunk), ARENA_ALIGNMENT);
+	}
+
+	void destroy() {
+		arenaChunk * chunk = _chunks;
+		while(chunk != NULL) {
+			arenaChunk * next = chunk->next;
+			BigHeap::getInstance().deallocateToBigHeap(chunk);
+			chunk = next;
+		}
+		_chunks = NULL;
+		_position = NULL;
+		_end = NULL;
+	}
+
+private:
+	arenaChunk * _chunks;
+	// The free part of the current chunk.
+	char * _position;
+	char * _end;
+	size_t _chunkSize;
+
+	// Takes a chunk of the given size and returns its payload. The current
+	// chunk, if any, is always the first listed: a chunk taken for a single
+	// object is listed behind it.
+	char * addChunk(size_t size, bool behindCurrent) {
+		arenaChunk * chunk = (arenaChunk *)BigHeap::getInstance().allocateChunkAtBigHeap(size);
+		if(behindCurrent) {
+			chunk->next = _chunks->next;
+			_chunks->next = chunk;
+		} else {
+			chunk->next = _chunks;
+			_chunks = chunk;
+		}
+		return (char *)chunk + alignup(sizeof(arenaChunk), ARENA_ALIGNMENT);
+	}
+};
+
+#endif // __ARENA_HH__
@@ -24,18 +24,108 @@
 #ifndef __BIBOPHEAP_H__
 #define __BIBOPHEAP_H__
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <unistd.h>
 #include "xdefines.hh"
 #include "mm.hh"
 #include "log.hh"
 #include "errmsg.hh"
+#ifdef GUARD_HELPER_THREAD
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "real.hh"
+#endif
+
+#include "fastrng.h"
+
+#ifdef RELEASE_FREE_PAGES
+// Empty pages found by the current thread that still await release.
+struct pageReleaseQueue {
+	unsigned numEntries;
+	struct {
+		char * addr;
+		size_t length;
+	} entries[PAGE_RELEASE_BATCH];
+};
+static __thread pageReleaseQueue _pageReleaseQueue;
+#endif
+
+#ifdef CFREELIST
+// Objects the current thread freed into a bag set owned by another thread,
+// chained together until they are handed over to the owner all at once.
+struct remoteFreeBatch {
+	slist_t * target;
+	slist_t * head;
+	slist_t * tail;
+	unsigned count;
+};
+static __thread remoteFreeBatch _remoteFreeBatches[REMOTE_FREE_SLOTS];
+#endif
+
+// The size classes, which are the same in every run: the powers of two from
+// BIBOP_MIN_BLOCK_SIZE to LARGE_OBJECT_THRESHOLD, and between each pair of
+// them, smallest first, steps of 1/BIBOP_CLASS_STEPS of the lower power (but
+// never finer than BIBOP_MIN_BLOCK_SIZE) for as long as spare bags remain.
+// With MANYBAGS these are 48, 80, 96, 112, 160, 192, 224, 320, 384, 448, 640
+// and 768.
+struct sizeClassTable {
+	size_t sizes[BIBOP_NUM_BAGS];
+	unsigned count;
+};
+
+constexpr sizeClassTable makeSizeClasses() {
+	sizeClassTable table = {};
+	unsigned numPowerClasses = LOG2(LARGE_OBJECT_THRESHOLD) - LOG2(BIBOP_MIN_BLOCK_SIZE) + 1;
+	// One spare bag is always kept to serve as the trailing guard area.
+	int spareBags = BIBOP_NUM_BAGS - (int)numPowerClasses - 1;
+
+	for(size_t base = BIBOP_MIN_BLOCK_SIZE; base <= LARGE_OBJECT_THRESHOLD && table.count < BIBOP_NUM_BAGS; base *= 2) {
+		table.sizes[table.count++] = base;
+		size_t step = base / BIBOP_CLASS_STEPS;
+		if(step < BIBOP_MIN_BLOCK_SIZE) {
+			step = BIBOP_MIN_BLOCK_SIZE;
+		}
+		for(size_t classSize = base + step; classSize < 2 * base && spareBags > 0; classSize += step) {
+			table.sizes[table.count++] = classSize;
+			spareBags--;
+		}
+	}
+	return table;
+}
+
+constexpr sizeClassTable _sizeClassTable = makeSizeClasses();
+
+// Checks what the heap relies upon: classes are increasing multiples of
+// BIBOP_MIN_BLOCK_SIZE that fit the bags and end at LARGE_OBJECT_THRESHOLD;
+// BIBOP_CLASS_LOOKUP_MAX is a class, and all classes above it are powers of
+// two, so that getBagNum() can round requests past the lookup table up.
+constexpr bool sizeClassesValid(const sizeClassTable & table) {
+	if(table.count == 0 || table.count > BIBOP_NUM_BAGS ||
+			table.sizes[table.count - 1] != LARGE_OBJECT_THRESHOLD) {
+		return false;
+	}
+	bool lookupMaxFound = false;
+	for(unsigned i = 0; i < table.count; i++) {
+		size_t classSize = table.sizes[i];
+		if(classSize % BIBOP_MIN_BLOCK_SIZE != 0 || (i > 0 && classSize <= table.sizes[i - 1])) {
+			return false;
+		}
+		if(classSize == BIBOP_CLASS_LOOKUP_MAX) {
+			lookupMaxFound = true;
+		} else if(classSize > BIBOP_CLASS_LOOKUP_MAX && classSize != 2 * table.sizes[i - 1]) {
+			return false;
+		}
+	}
+	return lookupMaxFound;
+}
 
-#ifdef SSE2RNG
-#include "sse2rng.h"
-#elif ARC4RNG
-extern "C" uint32_t arc4random_uniform(uint32_t upper_bound);
+static_assert(sizeClassesValid(_sizeClassTable), "invalid size class table");
+static_assert(MIN_RANDOM_BAG_SIZE >= LARGE_OBJECT_THRESHOLD, "bags must fit the largest class");
+#ifdef BIBOP_BAG_SIZE
+static_assert(BIBOP_BAG_SIZE >= LARGE_OBJECT_THRESHOLD, "bags must fit the largest class");
 #endif
 
 class BibopHeap {
@@ -50,17 +140,32 @@ private:
 	// The boundaries of the shadow memory region.
 	char * _shadowMemBegin;
 	char * _shadowMemEnd;
+	size_t _shadowMemSizePerSubHeap;
 	size_t _shadowMemSizePerHeap;
 	size_t _shadowMemSizePerHeapCeil;
 	unsigned _shadowMemSizePerHeapCeilShiftBits;
 	unsigned long _shadowMemSizePerHeapMask;
 	size_t _shadowObjectInfoSize;
 	unsigned _shadowObjectInfoSizeShiftBits;
+
+	#ifdef RELEASE_FREE_PAGES
+	// One occupancy counter per heap page, see occupyPages().
+	unsigned short * _pageOccupancy;
+	#endif
 	unsigned _numUsableBags;
 	unsigned _lastUsableBag;
 
 	size_t _bibopBagSize;
-	size_t _firstBagPower;
+	unsigned _numHeaps;
+	#ifdef TAGGED_HEAPS
+	// The untagged heaps come first, followed by the heaps of each tag.
+	unsigned _numUntaggedHeaps;
+	unsigned _numTagHeaps;
+	unsigned _tagHeapsShiftBits;
+	#endif
+	unsigned _numSubHeaps;
+	unsigned _numDedicatedSubHeaps;
+	unsigned _numSharedSubHeaps;
 	size_t _threadSize;
 	unsigned _threadShiftBits;
 
@@ -74,6 +179,17 @@ private:
 	unsigned long _numBagsPerHeap;
 	unsigned long _numBagsPerSubHeapMask;
 	unsigned _numBagsPerHeapShiftBits;
+
+	/*****************************************************
+		Size classes
+	******************************************************/
+	// The class size served by each bag number.
+	size_t _classSizes[BIBOP_NUM_BAGS];
+	// Maps (size + BIBOP_MIN_BLOCK_SIZE - 1) / BIBOP_MIN_BLOCK_SIZE to a bag
+	// number for all sizes up to BIBOP_CLASS_LOOKUP_MAX.
+	unsigned char _sizeClassLookup[BIBOP_CLASS_LOOKUP_ENTRIES];
+	// The bag number whose class size is BIBOP_CLASS_LOOKUP_MAX.
+	unsigned _lookupMaxBag;
 	
 	class alignas(CACHE_LINE_SIZE) PerThreadBag {
 		public:
@@ -83,19 +199,56 @@ private:
 			// The lock to protect the operations on freelist
 			pthread_spinlock_t listlock[BIBOP_BAG_SET_SIZE];
 
+			#ifdef REMOTE_FREELIST
+			// Objects freed by threads other than the owner, which are
+			// moved to freelist by the owner once the latter runs empty.
+			slist_t remotelist[BIBOP_BAG_SET_SIZE];
+			#endif
+
+			#ifdef THREAD_MAGAZINE
+			// Free objects reserved by the owner for its upcoming allocations.
+			void * magazine[MAGAZINE_DEPTH];
+			unsigned magCount;
+			// Whether the magazine was filled from the bump pointer.
+			bool magFresh;
+			// State of the generator that randomizes the order of magazine pops.
+			unsigned magSeed;
+			// Objects freed by the owner, which go back onto their freelists
+			// in batches.
+			shadowObjectInfo * freeMagazine[MAGAZINE_DEPTH];
+			unsigned freeMagCount;
+			#endif
+
 			// Pointing to the memory that is not allocated.
 			char * position[BIBOP_BAG_SET_SIZE];
 
 			// The address of last object in the current heap
 			char * lastofCurBag[BIBOP_BAG_SET_SIZE];
+			// The heaps of the bag's row, from firstHeap up to endHeap, and the end
+			// of the last one; a bag set whose bump pointer gets there has run out.
+			unsigned firstHeap;
+			unsigned endHeap;
+			char * heapLimit;
 			
 			unsigned numObjects;
 			unsigned lastObjectIndex;
 			unsigned bagNum;
 			unsigned threadIndex; 
-			unsigned long classMask;
+			// Whether the bag belongs to a subheap shared by several threads,
+			// which is always accessed under listlock.
+			bool shared;
+			// Whether the bump pointers and guard pages are set up; see prepareBag().
+			bool ready;
+			#ifdef TAGGED_HEAPS
+			// The tag whose row the bag is in, and the bytes and objects of that
+			// row's class allocated from the bag and not yet freed.
+			unsigned tag;
+			unsigned long liveBytes;
+			unsigned long liveObjects;
+			#endif
 			size_t classSize;	
-			size_t shiftBits;
+			// Fixed-point reciprocal of classSize, see getObjectIndex()
+			unsigned long classMagic;
 	
 			// Starting offset of the current bag in the current heap
 			size_t startOffset;
@@ -105,18 +258,59 @@ private:
 			size_t nextHeapObjectOffset;
 			size_t nextShadowHeapObjectOffset;
 
-      // cached free list  
-      slist_t cfreelist;
-      int ncfree;
-      int cflthreshold;
-			
 			#ifdef ENABLE_GUARDPAGE
       size_t guardsize;
       size_t guardoffset;
 			#endif
+
+			#ifdef RANDOM_GUARD
+			// The chunk each bump pointer is in, and which of its units are guards.
+			char * guardChunk[BIBOP_BAG_SET_SIZE];
+			unsigned long guardMap[BIBOP_BAG_SET_SIZE];
+			#ifdef GUARD_HELPER_THREAD
+			// The last chunks of each bag set requested from, and installed by,
+			// the guard helper thread, which handles them in order.
+			char * requestedChunk[BIBOP_BAG_SET_SIZE];
+			char * preparedChunk[BIBOP_BAG_SET_SIZE];
+			#endif
+			size_t guardChunkSize;
+			unsigned guardUnitShift;
+			#endif
+	};
+
+	// The bags of each subheap, allocated when the subheap is first used.
+	PerThreadBag * _threadBag[BIBOP_MAX_SUBHEAPS];
+	// The subheap-independent part of each bag.
+	PerThreadBag _bagTemplate[BIBOP_NUM_BAGS];
+	pthread_spinlock_t _subHeapLock;
+
+	// An object of a batch being freed, once it has been checked.
+	struct freedObject {
+		shadowObjectInfo * shadowinfo;
+		PerThreadBag * bag;
+		unsigned numBagSetItem;
 	};
 
-	PerThreadBag _threadBag[MAX_ALIVE_THREADS][BIBOP_NUM_BAGS];
+	#ifdef RANDOM_GUARD
+	// Secret from which the random guards of every chunk are derived.
+	unsigned long _guardSeed;
+	#endif
+
+	#ifdef GUARD_HELPER_THREAD
+	// Chunks whose guards the helper thread installs ahead of the bump pointers.
+	struct guardRequest {
+		PerThreadBag * bag;
+		unsigned numBagSetItem;
+		char * chunk;
+	};
+	guardRequest _guardRequests[GUARD_REQUEST_QUEUE_SIZE];
+	unsigned _guardRequestHead;
+	unsigned _guardRequestTail;
+	pthread_spinlock_t _guardRequestLock;
+	// Set while the helper sleeps until woken up; also serves as its futex word.
+	int _guardHelperWaiting;
+	bool _guardHelperRunning;
+	#endif
 
 public:
 	static BibopHeap & getInstance() {
@@ -126,8 +320,7 @@ public:
   }
 
 	void * initialize() {
-		unsigned threadNum, bagNum;
-		size_t lastUsableBagSize;
+		unsigned bagNum;
 
 		#ifdef BIBOP_BAG_SIZE
 		_bibopBagSize = BIBOP_BAG_SIZE;
@@ -136,23 +329,16 @@ public:
 		_bibopBagSize = MIN_RANDOM_BAG_SIZE << randPower;
 		#endif
 
-		if(_bibopBagSize > LARGE_OBJECT_THRESHOLD) {
-				lastUsableBagSize = LARGE_OBJECT_THRESHOLD;
-		} else {
-				lastUsableBagSize = _bibopBagSize;
-		}
-		_numUsableBags = LOG2(lastUsableBagSize) - LOG2(BIBOP_MIN_BLOCK_SIZE) + 1;
-		if(_numUsableBags > BIBOP_NUM_BAGS) {
-				_numUsableBags = BIBOP_NUM_BAGS;
-		}
+		_numUsableBags = initSizeClasses();
 		_lastUsableBag = _numUsableBags - 1;
 
+		initSubHeapCount();
+
 		assert(BIBOP_HEAP_SIZE > 0);
 
 		_shadowObjectInfoSize = sizeof(shadowObjectInfo);
 		_shadowObjectInfoSizeShiftBits = LOG2(sizeof(shadowObjectInfo));
 
-		_firstBagPower = LOG2(BIBOP_MIN_BLOCK_SIZE);
 		_bagShiftBits = LOG2(_bibopBagSize);
 		_threadSize = (_bibopBagSize * BIBOP_NUM_BAGS);
 		_threadShiftBits = LOG2(_threadSize);
@@ -161,6 +347,7 @@ public:
 		PRINF("_bibopBagSize=0x%lx, _bagShiftBits=%ld, sizeof(PerThreadBag)=%zu, _shadowObjectInfoSize=%zu",
 			_bibopBagSize, _bagShiftBits, sizeof(PerThreadBag), _shadowObjectInfoSize);
 		PRINF("BIBOP_NUM_BAGS=%u, _numUsableBags=%u", BIBOP_NUM_BAGS, _numUsableBags);
+		PRINF("_numHeaps=%u, _numSubHeaps=%u (%u shared)", _numHeaps, _numSubHeaps, _numSharedSubHeaps);
 
 		// _shadowObjectInfoSize must be a power of 2,
 		// otherwise _shadowObjectShiftBits logic won't work.
@@ -176,43 +363,30 @@ public:
 		assert(_bibopBagSize >= LARGE_OBJECT_THRESHOLD);
 
 		// Allocate the heap all at once.
-		size_t totalHeapSize = BIBOP_NUM_HEAPS * BIBOP_HEAP_SIZE;
+		size_t totalHeapSize = _numHeaps * BIBOP_HEAP_SIZE;
 		_heapMask = BIBOP_HEAP_SIZE - 1;
 		_heapSizeShiftBits = LOG2(BIBOP_HEAP_SIZE);
 		allocHeaps(totalHeapSize);
 
 		unsigned long numBagObjects;
 		unsigned long numCumObjects = 0;
-		unsigned long offsetBag = 0;
-		unsigned long offsetShadowMem = 0;
-		unsigned long shiftBits;
-		size_t unusableHeapSpace = (BIBOP_NUM_BAGS - _numUsableBags) * _bibopBagSize;
-
-		// Initialize each thread bag's free list, and other information
-		for(threadNum = 0; threadNum < MAX_ALIVE_THREADS; threadNum++) {
-			size_t classSize = BIBOP_MIN_BLOCK_SIZE;
-			shiftBits = LOG2(classSize);
-
-			for(bagNum = 0; bagNum < _numUsableBags; bagNum++) {
-				PerThreadBag * curBag = &_threadBag[threadNum][bagNum];
+
+		// Initialize the template of each bag, which holds all information that
+		// does not depend on the subheap; see materializeSubHeap().
+		for(bagNum = 0; bagNum < _numUsableBags; bagNum++) {
+				PerThreadBag * curBag = &_bagTemplate[bagNum];
+				size_t classSize = _classSizes[bagNum];
 				
 				curBag->classSize = classSize;
-				curBag->classMask = classSize - 1;
-				curBag->shiftBits = shiftBits;
-				for(int curBagSetItem = 0; curBagSetItem < BIBOP_BAG_SET_SIZE; curBagSetItem++) {
-						FREELIST_INIT(&curBag->freelist[curBagSetItem]);
-						pthread_spin_init(&curBag->listlock[curBagSetItem], 0);
-				}
-				initSLL(&curBag->cfreelist);
-				curBag->ncfree = 0;
+				curBag->classMagic = ((1UL << BIBOP_CLASS_MAGIC_SHIFT_BITS) + classSize - 1) / classSize;
 				curBag->bagNum = bagNum;
-				curBag->threadIndex = threadNum; 
-				curBag->startShadowMemOffset = offsetShadowMem;
-
-				numBagObjects = _bibopBagSize / classSize;
+				curBag->startOffset = bagNum * _bibopBagSize;
+				curBag->startShadowMemOffset = numCumObjects * _shadowObjectInfoSize;
 
 				#ifdef ENABLE_GUARDPAGE
-						size_t guardsize = classSize > PAGESIZE ? classSize : PAGESIZE;
+						// Bags are never smaller than the largest class, see sizeClassesValid().
+						size_t lastUsableBagSize = LARGE_OBJECT_THRESHOLD;
+						size_t guardsize = classSize > PAGESIZE ? alignup(classSize, PAGESIZE) : PAGESIZE;
 						size_t guardoffset = guardsize;
 						if(bagNum == _lastUsableBag) {
 								// If this bag can only fit one object, forego the use of a guard object.
@@ -220,7 +394,7 @@ public:
 										guardoffset = 0;
 										guardsize = 0;
 								}
-								guardsize += (BIBOP_NUM_BAGS - LOG2(lastUsableBagSize) + LOG2(BIBOP_MIN_BLOCK_SIZE) - 1) * _bibopBagSize;
+								guardsize += (BIBOP_NUM_BAGS - _numUsableBags) * _bibopBagSize;
 
 								//PRDBG("last usable bag: lastUsableBagSize=%zu, _bibopBagSize=%zu, guardsize=%zu, guardoffset=%zu",
 								//		lastUsableBagSize, _bibopBagSize, guardsize, guardoffset);
@@ -231,70 +405,55 @@ public:
 						size_t guardoffset = 0;
 				#endif
 
-						curBag->nextHeapObjectOffset = BIBOP_HEAP_SIZE * (BIBOP_BAG_SET_SIZE - 1) +
-								(BIBOP_HEAP_SIZE - _bibopBagSize + classSize + guardoffset);
-						for(int curBagSetItem = 0; curBagSetItem < BIBOP_BAG_SET_SIZE; curBagSetItem++) {
-								// Initialize bump pointer to the first object
-								curBag->position[curBagSetItem] = _heapBegin + offsetBag + (curBagSetItem * BIBOP_HEAP_SIZE);
-								curBag->lastofCurBag[curBagSetItem] = getLastOfBag(curBag->position[curBagSetItem], guardoffset, classSize);
-								//ptrdiff_t diff = curBag->lastofCurBag[curBagSetItem] - curBag->position[curBagSetItem];
-								//PRINF("thread %u bag %u set %d: classSize=%zu, guardsize=%zu, guardoffset=%zu, lastofCurBag=%p, position=%p, diff=%lu",
-								//				threadNum, bagNum, curBagSetItem, classSize, curBag->guardsize, guardoffset, curBag->lastofCurBag[curBagSetItem], curBag->position[curBagSetItem], diff);
-								#ifdef ENABLE_GUARDPAGE
-								setGuardPage(curBag->position[curBagSetItem], curBag->guardsize, guardoffset);
-								#endif
-						}
-
-						#ifdef ENABLE_GUARDPAGE
-						// We must perform this >1 test or else we will underflow this value
-						// for bags which have 0 objects in them. Also, the last usable bag
-						// will only contain a single object, but it will not be reduced to
-						// make room for a guard page, but rather the next bag (which is
-						// unusable) will be converted entirely into a guard page. 
-						if(numBagObjects > 1) {
-								if(classSize < PageSize) {
-										numBagObjects -= (PageSize / classSize);
-								} else {
-										numBagObjects--;
-								}
+				#ifdef RANDOM_GUARD
+						// Classes above a page are powers of two, and are guarded an
+						// object at a time; smaller ones a page at a time.
+						curBag->guardUnitShift = (classSize > PageSize) ? LOG2(classSize) : PageSizeShiftBits;
+						curBag->guardChunkSize = RANDOM_GUARD_CHUNK_SIZE;
+						if(curBag->guardChunkSize < (1UL << curBag->guardUnitShift)) {
+								curBag->guardChunkSize = 1UL << curBag->guardUnitShift;
 						}
-						#endif
+				#endif
 
+						// Whatever does not fit in front of the guard area is left unused;
+						// for classes that are not a power of two this includes a tail
+						// shorter than one object.
+						numBagObjects = (_bibopBagSize - guardoffset) / classSize;
+						curBag->numObjects = numBagObjects;
+						curBag->lastObjectIndex = numBagObjects - 1;
 
-				curBag->cflthreshold = numBagObjects / CACHEDFREELIST_THRESHOLD_RATIO_BYBAG;
-				curBag->startOffset = offsetBag;
-				curBag->numObjects = numBagObjects;
-				curBag->lastObjectIndex = numBagObjects - 1;
+						// Distance from the last object of a bag to the first object of the
+						// same bag in the next heap belonging to this bag set.
+						curBag->nextHeapObjectOffset = BIBOP_HEAP_SIZE * BIBOP_BAG_SET_SIZE -
+								curBag->lastObjectIndex * classSize;
 
-				// Update the following values; 
 				numCumObjects += numBagObjects;
-				offsetBag += _bibopBagSize;
-				offsetShadowMem += numBagObjects * _shadowObjectInfoSize;
-				shiftBits++;
-				classSize *= 2;
-			}
-			offsetBag += unusableHeapSpace;
 		}
 
 		_numBagsPerSubHeapMask = BIBOP_NUM_BAGS - 1;
-		_numBagsPerHeap = BIBOP_NUM_BAGS * BIBOP_NUM_SUBHEAPS;
+		_numBagsPerHeap = BIBOP_NUM_BAGS * _numSubHeaps;
 		_numBagsPerHeapShiftBits = LOG2(_numBagsPerHeap);
-		_numObjectsPerHeap = numCumObjects;
-		_numObjectsPerSubHeap = numCumObjects / BIBOP_NUM_SUBHEAPS;
+		_numObjectsPerSubHeap = numCumObjects;
+		_numObjectsPerHeap = _numObjectsPerSubHeap * _numSubHeaps;
+		_shadowMemSizePerSubHeap = _numObjectsPerSubHeap * _shadowObjectInfoSize;
 		_shadowMemSizePerHeap = _numObjectsPerHeap * _shadowObjectInfoSize;
 		_shadowMemSizePerHeapCeilShiftBits = (sizeof(size_t) * 8) - __builtin_clzl(_shadowMemSizePerHeap - 1);
 		_shadowMemSizePerHeapCeil = (1ULL << _shadowMemSizePerHeapCeilShiftBits); 
 		_shadowMemSizePerHeapMask = _shadowMemSizePerHeapCeil - 1; 
 
-		// Iterate through the PerThreadBag array once more, setting the 
-		for(threadNum = 0; threadNum < MAX_ALIVE_THREADS; threadNum++) {
-				for(bagNum = 0; bagNum < _numUsableBags; bagNum++) {
-						PerThreadBag * curBag = &_threadBag[threadNum][bagNum];
-						curBag->nextShadowHeapObjectOffset = _shadowMemSizePerHeapCeil * BIBOP_BAG_SET_SIZE -
-								((unsigned long)(curBag->numObjects - 1) << _shadowObjectInfoSizeShiftBits);
-				}
+		for(bagNum = 0; bagNum < _numUsableBags; bagNum++) {
+				PerThreadBag * curBag = &_bagTemplate[bagNum];
+				curBag->nextShadowHeapObjectOffset = _shadowMemSizePerHeapCeil * BIBOP_BAG_SET_SIZE -
+						((unsigned long)(curBag->numObjects - 1) << _shadowObjectInfoSizeShiftBits);
 		}
 
+		pthread_spin_init(&_subHeapLock, PTHREAD_PROCESS_PRIVATE);
+
+		#ifdef RANDOM_GUARD
+		_guardSeed = (uintptr_t)_heapBegin ^ time(NULL);
+		_guardSeed ^= ((unsigned long)getRandomNumber() << 32) | getRandomNumber();
+		#endif
+
 		allocShadowMem();
 		PRINF("_shadowMemBegin=%p, _shadowMemEnd=%p, _shadowMemSizePerHeap=%zu, _smSPHeapCeilShiftBits=%u",
 						_shadowMemBegin, _shadowMemEnd, _shadowMemSizePerHeap, _shadowMemSizePerHeapCeilShiftBits);
@@ -302,209 +461,1019 @@ public:
 		return _heapBegin;
 	}
 
+	// Chooses the number of subheaps: the value of BIBOP_SUBHEAPS_ENV if set,
+	// and otherwise two per CPU we may run on, but at least BIBOP_MIN_SUBHEAPS.
+	// The heap area spans BIBOP_HEAP_AREA_SIZE bytes regardless, so more
+	// subheaps means fewer heaps, and less memory for each bag set. The heaps
+	// of tagged bags come on top of these.
+	void initSubHeapCount() {
+		unsigned long numSubHeaps = 0;
+		char * env = getenv(BIBOP_SUBHEAPS_ENV);
+		if(env) {
+				numSubHeaps = strtoul(env, NULL, 10);
+		}
+		if(numSubHeaps == 0) {
+				// sched_getaffinity, unlike sysconf, does not allocate memory.
+				cpu_set_t cpus;
+				unsigned numCPUs = 1;
+				if(sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+						numCPUs = CPU_COUNT(&cpus);
+				}
+				numSubHeaps = 2 * numCPUs;
+				if(numSubHeaps < BIBOP_MIN_SUBHEAPS) {
+						numSubHeaps = BIBOP_MIN_SUBHEAPS;
+				}
+		}
+		if(numSubHeaps < 2) {
+				numSubHeaps = 2;
+		} else if(numSubHeaps > BIBOP_MAX_SUBHEAPS) {
+				numSubHeaps = BIBOP_MAX_SUBHEAPS;
+		}
+
+		_numSubHeaps = 1U << (64 - __builtin_clzl(numSubHeaps - 1));
+		_numHeaps = BIBOP_HEAP_AREA_SIZE / BIBOP_HEAP_SIZE;
+
+		#ifdef TAGGED_HEAPS
+		_numUntaggedHeaps = _numHeaps;
+		_numTagHeaps = BIBOP_TAG_AREA_SIZE / BIBOP_HEAP_SIZE;
+		if(_numTagHeaps < BIBOP_BAG_SET_SIZE) {
+				_numTagHeaps = BIBOP_BAG_SET_SIZE;
+		}
+		_tagHeapsShiftBits = LOG2(_numTagHeaps);
+		_numHeaps += (BIBOP_TAG_ROWS - 1) * _numTagHeaps;
+		#endif
+
+		// Dedicate a subheap to each thread index if there are enough of them.
+		// Otherwise, threads with an index beyond the dedicated subheaps share
+		// the remaining ones.
+		if(_numSubHeaps >= MAX_ALIVE_THREADS) {
+				_numSharedSubHeaps = 0;
+		} else {
+				_numSharedSubHeaps = _numSubHeaps / BIBOP_SHARED_SUBHEAP_RATIO;
+				if(_numSharedSubHeaps == 0) {
+						_numSharedSubHeaps = 1;
+				}
+		}
+		_numDedicatedSubHeaps = _numSubHeaps - _numSharedSubHeaps;
+	}
+
+	// Returns the subheap serving the given thread index.
+	inline unsigned getSubHeapIndex(int threadIndex) {
+		if((unsigned)threadIndex < _numDedicatedSubHeaps) {
+				return threadIndex;
+		}
+		return _numDedicatedSubHeaps + (threadIndex % _numSharedSubHeaps);
+	}
+
+	// Returns the bags of a subheap, setting them up on first use. Only the
+	// bookkeeping is set up here; each bag is prepared by prepareBag().
+	inline PerThreadBag * getSubHeapBags(unsigned subHeap) {
+		PerThreadBag * bags = __atomic_load_n(&_threadBag[subHeap], __ATOMIC_ACQUIRE);
+		if(bags == NULL) {
+				bags = materializeSubHeap(subHeap);
+		}
+		return bags;
+	}
+
+	PerThreadBag * materializeSubHeap(unsigned subHeap) {
+		pthread_spin_lock(&_subHeapLock);
+		PerThreadBag * bags = _threadBag[subHeap];
+		if(bags != NULL) {
+				pthread_spin_unlock(&_subHeapLock);
+				return bags;
+		}
+
+		bags = (PerThreadBag *)MM::mmapAllocatePrivate(sizeof(PerThreadBag) * BIBOP_NUM_BAGS * BIBOP_TAG_ROWS);
+		bool shared = (subHeap >= _numDedicatedSubHeaps);
+
+		for(unsigned rowBagNum = 0; rowBagNum < BIBOP_NUM_BAGS * BIBOP_TAG_ROWS; rowBagNum++) {
+				unsigned bagNum = rowBagNum % BIBOP_NUM_BAGS;
+				if(bagNum >= _numUsableBags) {
+						continue;
+				}
+				PerThreadBag * curBag = &bags[rowBagNum];
+				memcpy(curBag, &_bagTemplate[bagNum], sizeof(PerThreadBag));
+
+				curBag->threadIndex = (shared ? BIBOP_SHARED_OWNER : subHeap);
+				curBag->shared = shared;
+				curBag->startOffset += subHeap * _threadSize;
+				curBag->startShadowMemOffset += subHeap * _shadowMemSizePerSubHeap;
+				#ifdef TAGGED_HEAPS
+				unsigned tag = rowBagNum / BIBOP_NUM_BAGS;
+				curBag->tag = tag;
+				if(tag == 0) {
+						curBag->firstHeap = 0;
+						curBag->endHeap = _numUntaggedHeaps;
+				} else {
+						curBag->firstHeap = _numUntaggedHeaps + (tag - 1) * _numTagHeaps;
+						curBag->endHeap = curBag->firstHeap + _numTagHeaps;
+				}
+				#else
+				curBag->firstHeap = 0;
+				curBag->endHeap = _numHeaps;
+				#endif
+				curBag->heapLimit = _heapBegin + curBag->endHeap * BIBOP_HEAP_SIZE;
+
+				for(int curBagSetItem = 0; curBagSetItem < BIBOP_BAG_SET_SIZE; curBagSetItem++) {
+						FREELIST_INIT(&curBag->freelist[curBagSetItem]);
+						pthread_spin_init(&curBag->listlock[curBagSetItem], 0);
+						#ifdef REMOTE_FREELIST
+						initSLL(&curBag->remotelist[curBagSetItem]);
+						#endif
+				}
+		}
+
+		__atomic_store_n(&_threadBag[subHeap], bags, __ATOMIC_RELEASE);
+		pthread_spin_unlock(&_subHeapLock);
+		return bags;
+	}
+
+	// Sets up the bump pointers of a bag, and the guard pages behind its first
+	// bag in each bag set. This is deferred until the first allocation from the
+	// bag, so that only the classes a thread actually uses cost any system calls.
+	void prepareBag(PerThreadBag * curBag) {
+		pthread_spin_lock(&_subHeapLock);
+		if(curBag->ready) {
+				pthread_spin_unlock(&_subHeapLock);
+				return;
+		}
+
+		for(int curBagSetItem = 0; curBagSetItem < BIBOP_BAG_SET_SIZE; curBagSetItem++) {
+				// Initialize bump pointer to the first object
+				curBag->position[curBagSetItem] = _heapBegin + curBag->startOffset + ((curBag->firstHeap + curBagSetItem) * BIBOP_HEAP_SIZE);
+				curBag->lastofCurBag[curBagSetItem] = getLastOfBag(curBag->position[curBagSetItem], curBag);
+				//ptrdiff_t diff = curBag->lastofCurBag[curBagSetItem] - curBag->position[curBagSetItem];
+				//PRINF("thread %u bag %u set %d: classSize=%zu, guardsize=%zu, guardoffset=%zu, lastofCurBag=%p, position=%p, diff=%lu",
+				//				curBag->threadIndex, curBag->bagNum, curBagSetItem, curBag->classSize, curBag->guardsize, curBag->guardoffset, curBag->lastofCurBag[curBagSetItem], curBag->position[curBagSetItem], diff);
+				#ifdef RANDOM_GUARD
+				// This also sets the guard at the end of the bag.
+				enterGuardChunk(curBag, curBagSetItem, curBag->position[curBagSetItem]);
+				#elif defined(ENABLE_GUARDPAGE)
+				setGuardPage(curBag->position[curBagSetItem], curBag->guardsize, curBag->guardoffset);
+				#endif
+		}
+
+		__atomic_store_n(&curBag->ready, true, __ATOMIC_RELEASE);
+		pthread_spin_unlock(&_subHeapLock);
+	}
+
+	// Copies the size classes into place and builds the small-size lookup
+	// table. Returns the number of usable bags.
+	unsigned initSizeClasses() {
+		unsigned numClasses = _sizeClassTable.count;
+		for(unsigned i = 0; i < numClasses; i++) {
+				_classSizes[i] = _sizeClassTable.sizes[i];
+		}
+
+		unsigned bagNum = 0;
+		for(unsigned entry = 0; entry < BIBOP_CLASS_LOOKUP_ENTRIES; entry++) {
+				while(_classSizes[bagNum] < entry * BIBOP_MIN_BLOCK_SIZE) {
+						bagNum++;
+				}
+				_sizeClassLookup[entry] = bagNum;
+		}
+		_lookupMaxBag = _sizeClassLookup[BIBOP_CLASS_LOOKUP_ENTRIES - 1];
+
+		for(unsigned i = 0; i < numClasses; i++) {
+				PRINF("size class %u: %zu bytes", i, _classSizes[i]);
+		}
+
+		return numClasses;
+	}
+
+	// The heap is aligned to the bag size, so that objects of power-of-two
+	// classes are aligned to their size.
 	void allocHeaps(size_t heapSize) {
-			_heapBegin = (char *)MM::mmapAllocatePrivate(heapSize, NULL);
+			char * reserved = (char *)MM::mmapAllocatePrivate(heapSize + _bibopBagSize, NULL);
+			_heapBegin = (char *)alignupPointer(reserved, _bibopBagSize);
 			_heapEnd = _heapBegin + heapSize;
+			if(_heapBegin > reserved) {
+					MM::mmapDeallocate(reserved, _heapBegin - reserved);
+			}
+			MM::mmapDeallocate(_heapEnd, reserved + _bibopBagSize - _heapBegin);
 			madvise(_heapBegin, heapSize, MADV_NOHUGEPAGE);
 			PRINF("_heapBegin=%p, _heapEnd=%p", _heapBegin, _heapEnd);
 	}
 
 	void allocShadowMem() {
-      size_t totalShadowMemSize = BIBOP_NUM_HEAPS * _shadowMemSizePerHeap;
+      size_t totalShadowMemSize = _numHeaps * _shadowMemSizePerHeapCeil;
       _shadowMemBegin = (char *)MM::mmapAllocatePrivate(totalShadowMemSize, NULL);
       _shadowMemEnd = _shadowMemBegin + totalShadowMemSize;
 			madvise(_shadowMemBegin, totalShadowMemSize, MADV_NOHUGEPAGE);
+
+			#ifdef RELEASE_FREE_PAGES
+			size_t pageOccupancySize = ((_heapEnd - _heapBegin) >> PageSizeShiftBits) * sizeof(unsigned short);
+			_pageOccupancy = (unsigned short *)MM::mmapAllocatePrivate(pageOccupancySize, NULL);
+			madvise(_pageOccupancy, pageOccupancySize, MADV_NOHUGEPAGE);
+			#endif
 	}
 
   size_t getUsableSize(void * ptr) {
     unsigned numBagSetItem;
     PerThreadBag *bag;
-    (void)getShadowObjectInfo(ptr, &bag, &numBagSetItem);
+    shadowObjectInfo * shadowinfo = getShadowObjectInfo(ptr, &bag, &numBagSetItem);
 
     //void * addrEnd = (void *)((uintptr_t)addr + bag->classSize);
     //PRDBG("thread %u bag %u set %u freeing object %p ~ %p",
     //  bag->threadIndex, bag->bagNum, numBagSetItem, addr, addrEnd);
-    #ifdef USE_CANARY
-    return (bag->classSize - 1);
-    #else
-    return bag->classSize;
-    #endif
+    return getUsableSize(shadowinfo, bag);
   }
 
-	// The major routine of allocate a small object 
-	void * allocateSmallObject(size_t sz) {
+	// The major routine of allocate a small object. If zeroed is given, it is
+	// set to whether the object is known to hold only zeroes.
+	void * allocateSmallObject(size_t sz, bool * zeroed = NULL) {
+		// compute the bag number, which leaves room for the canary
+		return allocateFromBag(sz, getBagNum(sz), zeroed);
+	}
+
+	#ifdef TAGGED_HEAPS
+	// Allocates an object from the bags of the given tag, which are apart from
+	// those of other tags and of untagged objects.
+	void * allocateTaggedObject(size_t sz, unsigned tag) {
+		return allocateFromBag(sz, getBagNum(sz), NULL, tag);
+	}
+
+	// Sums up the objects of the given tag still in use, over all subheaps.
+	void getTagStats(unsigned tag, unsigned long * liveBytes, unsigned long * liveObjects) {
+		*liveBytes = 0;
+		*liveObjects = 0;
+		for(unsigned subHeap = 0; subHeap < _numSubHeaps; subHeap++) {
+			PerThreadBag * bags = __atomic_load_n(&_threadBag[subHeap], __ATOMIC_ACQUIRE);
+			if(bags == NULL) {
+				continue;
+			}
+			for(unsigned bagNum = 0; bagNum < _numUsableBags; bagNum++) {
+				PerThreadBag * bag = &bags[tag * BIBOP_NUM_BAGS + bagNum];
+				*liveBytes += __atomic_load_n(&bag->liveBytes, __ATOMIC_RELAXED);
+				*liveObjects += __atomic_load_n(&bag->liveObjects, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	#endif
+
+	// Allocates an object aligned to the given power of two from the smallest
+	// class whose size is a multiple of it: as bags are aligned to their size,
+	// all objects of such a class are. Returns NULL if there is no such class.
+	void * allocateAlignedSmallObject(size_t sz, size_t alignment, bool * zeroed = NULL) {
+		int bagNum = getAlignedBagNum(sz, alignment);
+		if(bagNum < 0) {
+			return NULL;
+		}
+		return allocateFromBag(sz, bagNum, zeroed);
+	}
+
+	// Returns the usable size of an object allocated for the given request, or
+	// 0 if there is no class to serve it.
+	size_t getAllocationSize(size_t sz, size_t alignment) {
+		int bagNum = getAlignedBagNum(sz, alignment);
+		if(bagNum < 0) {
+			return 0;
+		}
+		size_t classSize = _classSizes[bagNum];
+		#ifdef USE_CANARY
+		// See setCanary().
+		if(sz < classSize) {
+			return classSize - 1;
+		}
+		#endif
+		return classSize;
+	}
+
+	// Returns the smallest class of at least sz bytes whose size is a multiple of
+	// alignment, or -1 if there is none.
+	inline int getAlignedBagNum(size_t sz, size_t alignment) {
+		for(unsigned bagNum = getBagNum(sz); bagNum < _numUsableBags; bagNum++) {
+			if((_classSizes[bagNum] & (alignment - 1)) == 0) {
+				return bagNum;
+			}
+		}
+		return -1;
+	}
+
+	void * allocateFromBag(size_t sz, unsigned bagNum, bool * zeroed, unsigned tag = 0) {
 		#ifdef CUSTOMIZED_STACK
 		int threadIndex = getThreadIndex(&sz);
 		#else
 		int threadIndex = getThreadIndex();
 		#endif
-		size_t classSize;
 		void * ptr;		
 
-		#ifdef USE_CANARY
-		sz++;		// make room for the buffer overflow canary
-		#endif
+		PerThreadBag * curBag = &getSubHeapBags(getSubHeapIndex(threadIndex))[tag * BIBOP_NUM_BAGS + bagNum];
+		shadowObjectInfo * shadowinfo = NULL;
 
-    if(sz <= BIBOP_MIN_BLOCK_SIZE) {
-      classSize = BIBOP_MIN_BLOCK_SIZE;
-    } else {
-      classSize = (1ULL << 32) >> __builtin_clz(sz - 1);
-    }
+		if(!__atomic_load_n(&curBag->ready, __ATOMIC_ACQUIRE)) {
+			prepareBag(curBag);
+		}
 
-		// compute the bag number
-		unsigned bagNum = getBagNum(classSize);
+		#ifdef THREAD_MAGAZINE
+		if(curBag->classSize <= MAGAZINE_MAX_CLASS_SIZE && !curBag->shared) {
+			ptr = allocateFromMagazine(curBag);
+			if(ptr == NULL) {
+				errno = ENOMEM;
+				return NULL;
+			}
+			return markAllocated(ptr, sz, curBag, curBag->magFresh, zeroed);
+		}
+		#endif
 
-		PerThreadBag * curBag = &_threadBag[threadIndex][bagNum]; 
-		shadowObjectInfo * shadowinfo = NULL;
+		bool useBumpPointer;
+		unsigned numBagSetItem = selectBagSet(&useBumpPointer);
 
-    #if (BIBOP_BAG_SET_SIZE <= 1)
-    // If there's only one posible bag we do not need to perform
-    // the AND operation to select it.
-    unsigned numBagSetItem = 0;
-    bool useBumpPointer = false;
-    #else
-    unsigned randNum = getRandomNumber();
-    unsigned numBagSetItem = randNum & BIBOP_BAG_SET_MASK;
-    // There are 1-in-BIBOP_BAG_SET_RANDOMIZER odds that we will use the
-    // bump pointer, despite possibly having free objects to choose from.
-    bool useBumpPointer = ((randNum & BIBOP_BAG_SET_RANDOMIZER_MASK) == 0);
-    #endif
+		#ifdef REMOTE_FREELIST
+		if(IS_FREELIST_EMPTY(&curBag->freelist[numBagSetItem])) {
+			drainRemoteList(curBag, numBagSetItem);
+		}
+		#endif
 
-		lock(curBag, numBagSetItem);
+		// Memory at the bump pointer has never been handed out.
+		bool fresh = false;
+		ownerLock(curBag, numBagSetItem);
 		// If yes, then alloate an object from the freelist.
 		if(!IS_FREELIST_EMPTY(&curBag->freelist[numBagSetItem]) && !useBumpPointer) {
 			// LTP: it is good to add this to the paper since we are using the 
 			// per-bag lock, instead of using the per-thread lock.
 			// Also, only the allocation from the freelist will require a lock
 			shadowinfo = (shadowObjectInfo *)FREELIST_REMOVE(&curBag->freelist[numBagSetItem]);
-			unlock(curBag, numBagSetItem);
+			ownerUnlock(curBag, numBagSetItem);
 			ptr = getAddrFromShadowInfo(shadowinfo, curBag);
 		} else {
-			unlock(curBag, numBagSetItem);
-
-			char ** position = &curBag->position[numBagSetItem];
-
-			// Save the current value of the position pointer, as this will be used to allocate
-			// the object requested by the caller. The position pointer will then be modified to
-			// point to the next available object.
-			ptr = *position;
-
-			incrementBumpPointer(curBag, numBagSetItem);
+			ownerUnlock(curBag, numBagSetItem);
+			ptr = allocateFromBumpPointer(curBag, numBagSetItem);
+			fresh = true;
+		}
 
-			#ifdef RANDOM_GUARD
-			if(((uintptr_t)*position & PageMask) == 0) {
-					tryRandomGuardPage(curBag, numBagSetItem);
+		if(ptr == NULL) {
+			ptr = allocateFromAnyBagSet(curBag, &fresh);
+			if(ptr == NULL) {
+				errno = ENOMEM;
+				return NULL;
 			}
-			#endif
 		}
 
-		shadowinfo = getShadowObjectInfo(ptr, curBag);
-
 		//void * ptrEnd = (void *)((uintptr_t)ptr + curBag->classSize);
 		//char * canary_dbg = (char *)ptr + curBag->classSize - 1;
-		//PRDBG("thread %u bag %u set %u malloc size %zu(%zu) @ %p ~ %p (canary @ %p, sm @ %p)",
+		//PRDBG("thread %u bag %u set %u malloc size %zu(%zu) @ %p ~ %p (canary @ %p)",
 		//	curBag->threadIndex, curBag->bagNum, numBagSetItem, sz, curBag->classSize,
-		//	ptr, ptrEnd, canary_dbg, shadowinfo);
+		//	ptr, ptrEnd, canary_dbg);
 
-		#ifdef USE_CANARY
-		char * canary = (char *)ptr + curBag->classSize - 1;
-		*canary = CANARY_SENTINEL;
+		return markAllocated(ptr, sz, curBag, fresh, zeroed);
+	}
+
+	// Allocates count objects of sz bytes into objects. The class and bag are
+	// looked up once; a bag set is then picked at random for every run of up to
+	// BATCH_ALLOC_RUN objects, which are taken from its freelist under a single
+	// lock acquisition, or else from its bump pointer in one sweep. Returns the
+	// number of objects allocated, which is short of count only once the bag has
+	// run out.
+	size_t allocateSmallObjectBatch(size_t sz, size_t count, void ** objects) {
+		#ifdef CUSTOMIZED_STACK
+		int threadIndex = getThreadIndex(&sz);
+		#else
+		int threadIndex = getThreadIndex();
 		#endif
 
-		shadowinfo->listentry.next = ALLOC_SENTINEL;
+		PerThreadBag * curBag = &getSubHeapBags(getSubHeapIndex(threadIndex))[getBagNum(sz)];
+		if(!__atomic_load_n(&curBag->ready, __ATOMIC_ACQUIRE)) {
+			prepareBag(curBag);
+		}
 
-		return ptr;
-	}
+		#ifdef THREAD_MAGAZINE
+		if(curBag->classSize <= MAGAZINE_MAX_CLASS_SIZE && !curBag->shared) {
+			for(size_t i = 0; i < count; i++) {
+				void * ptr = allocateFromMagazine(curBag);
+				if(ptr == NULL) {
+					errno = ENOMEM;
+					return i;
+				}
+				objects[i] = markAllocated(ptr, sz, curBag, curBag->magFresh, NULL);
+			}
+			return count;
+		}
+		#endif
 
-	inline void incrementBumpPointer(PerThreadBag * curBag, unsigned numBagSetItem) {
-			char ** position = &curBag->position[numBagSetItem];
-			char ** lastofCurBag = &curBag->lastofCurBag[numBagSetItem];
+		size_t done = 0;
+		while(done < count) {
+			unsigned run = (count - done < BATCH_ALLOC_RUN) ? (count - done) : BATCH_ALLOC_RUN;
+			void ** runObjects = &objects[done];
+			unsigned taken = 0;
+
+			bool useBumpPointer;
+			unsigned numBagSetItem = selectBagSet(&useBumpPointer);
+			if(!useBumpPointer) {
+				#ifdef REMOTE_FREELIST
+				if(IS_FREELIST_EMPTY(&curBag->freelist[numBagSetItem])) {
+					drainRemoteList(curBag, numBagSetItem);
+				}
+				#endif
 
-			//unsigned heapNum = getHeapNumber(*position);
-			//PRDBG("thread %u bag %u set %u: heap=%u, position=%p, lastofCurBag=%p",
-			//				curBag->threadIndex, curBag->bagNum, numBagSetItem, heapNum, *position,
-			//				*lastofCurBag);
+				ownerLock(curBag, numBagSetItem);
+				while(taken < run && !IS_FREELIST_EMPTY(&curBag->freelist[numBagSetItem])) {
+					runObjects[taken++] = FREELIST_REMOVE(&curBag->freelist[numBagSetItem]);
+				}
+				ownerUnlock(curBag, numBagSetItem);
 
-			// Check whether this object is the last one on the current bag...
-			if(*position < *lastofCurBag) {
-					// We're still inside the current bag.
-					*position += curBag->classSize;
-			} else {
-					// We will now point to the next heap.
-					*position += curBag->nextHeapObjectOffset;
+				for(unsigned i = 0; i < taken; i++) {
+					void * ptr = getAddrFromShadowInfo((shadowObjectInfo *)runObjects[i], curBag);
+					runObjects[i] = markAllocated(ptr, sz, curBag, false, NULL);
+				}
+			}
 
-					#ifdef ENABLE_GUARDPAGE
-					// check whether only one object is in bag
-					size_t guardoffset = curBag->guardoffset;
-					// set a guard page at the end of this new bag
-					setGuardPage(*position, curBag->guardsize, guardoffset);
-					#else
-					size_t guardoffset = 0;
-					#endif
+			if(taken < run) {
+				unsigned bumped = allocateRunFromBumpPointer(curBag, numBagSetItem, &runObjects[taken], run - taken);
+				for(unsigned i = taken; i < taken + bumped; i++) {
+					markAllocated(runObjects[i], sz, curBag, true, NULL);
+				}
+				taken += bumped;
+			}
+			if(taken < run) {
+				bool fresh;
+				void * ptr = allocateFromAnyBagSet(curBag, &fresh);
+				if(ptr == NULL) {
+					errno = ENOMEM;
+					return done + taken;
+				}
+				runObjects[taken++] = markAllocated(ptr, sz, curBag, fresh, NULL);
+			}
+			done += taken;
+		}
+		return count;
+	}
 
-					//void * oldValue = *lastofCurBag;
-					*lastofCurBag = getLastOfBag(*position, guardoffset, curBag->classSize);
-					//unsigned heapNum = getHeapNumber(*position);
-					//PRDBG("thread %u bag %u set %u: moved to heap number %u: bag start=%p, lastofCurBag=%p",
-					//				curBag->threadIndex, curBag->bagNum, numBagSetItem, heapNum, oldValue, *lastofCurBag);
+	// Picks one of the bag sets at random. There are 1-in-BIBOP_BAG_SET_RANDOMIZER
+	// odds that useBumpPointer is set, in which case the caller should use the
+	// bump pointer despite possibly having free objects to choose from.
+	inline unsigned selectBagSet(bool * useBumpPointer, unsigned * randNumOut = NULL) {
+    #if (BIBOP_BAG_SET_SIZE <= 1)
+    // If there's only one posible bag we do not need to perform
+    // the AND operation to select it.
+    *useBumpPointer = false;
+    if(randNumOut) {
+      *randNumOut = getRandomNumber();
+    }
+    return 0;
+    #else
+    unsigned randNum = getRandomNumber();
+    *useBumpPointer = ((randNum & BIBOP_BAG_SET_RANDOMIZER_MASK) == 0);
+    if(randNumOut) {
+      *randNumOut = randNum;
+    }
+    return randNum & BIBOP_BAG_SET_MASK;
+    #endif
+	}
+
+	// Takes the object at the bump pointer of the given bag set, or returns
+	// NULL if the bag set has run out.
+	inline void * allocateFromBumpPointer(PerThreadBag * curBag, unsigned numBagSetItem) {
+			void * ptr;
+			if(allocateRunFromBumpPointer(curBag, numBagSetItem, &ptr, 1) == 0) {
+					return NULL;
 			}
+			return ptr;
 	}
 
-	// Tries to place a random guard page at the current location
-	// of the specified bag.
-	bool tryRandomGuardPage(PerThreadBag * curBag, unsigned numBagSetItem) {
+	// Takes up to count objects at the bump pointer of the given bag set, and
+	// returns how many it took: fewer only if the bag set has run out.
+	inline unsigned allocateRunFromBumpPointer(PerThreadBag * curBag, unsigned numBagSetItem, void ** objects, unsigned count) {
+			if(curBag->shared) {
+					lock(curBag, numBagSetItem);
+			}
 			char ** position = &curBag->position[numBagSetItem];
-			void * savedPosition = (void *)curBag->position[numBagSetItem];
-			size_t classSize = curBag->classSize;
 
-			if(getRandomNumber() < RANDOM_GUARD_RAND_CUTOFF) {
-					size_t guardSize;
-					if(classSize < PageSize) {
-							guardSize = PageSize;
-							unsigned numObjectsPerPageLessOne = PageSize / classSize - 1;
-							// For the purposes of the caller (allocateSmallObject()), we want
-							// it to assume we are operating on the last object of this page;
-							// thus, we should increment the bump pointer by the number of
-							// objects that make up a page, minus one.
-							*position += numObjectsPerPageLessOne * classSize; 
-					} else {
-							guardSize = classSize;
-					}
-					mprotect(savedPosition, guardSize, PROT_NONE);
-					/*
-					if(mprotect(savedPosition, guardSize, PROT_NONE) == -1) {
-							PRERR("mprotect(%p, %zu, PROT_NONE) failed: %s", savedPosition, guardSize, strerror(errno));
-					}
-					*/
+			unsigned i;
+			for(i = 0; i < count && *position < curBag->heapLimit; i++) {
+					// Save the current value of the position pointer, as this will be used to allocate
+					// the object requested by the caller. The position pointer will then be modified to
+					// point to the next available object.
+					objects[i] = *position;
 
 					incrementBumpPointer(curBag, numBagSetItem);
-					return true;
+
+					#ifdef RANDOM_GUARD
+					if(startsNewPage(*position, curBag->classSize)) {
+							skipRandomGuard(curBag, numBagSetItem);
+					}
+					#endif
 			}
-			return false;
-	}
 
-  size_t getObjectSize(void * addr) {
-    if(isInvalidAddr(addr)) {
-      return -1;
-    }
+			if(curBag->shared) {
+					unlock(curBag, numBagSetItem);
+			}
+			return i;
+	}
 
-    PerThreadBag *bag;
-    getShadowObjectInfo(addr, &bag);
+	// Takes an object from whichever bag set still has one, once the one
+	// picked has run out: from a freelist if possible, and otherwise from a
+	// bump pointer. Returns NULL if the bag has run out altogether.
+	void * allocateFromAnyBagSet(PerThreadBag * curBag, bool * fresh) {
+			for(unsigned numBagSetItem = 0; numBagSetItem < BIBOP_BAG_SET_SIZE; numBagSetItem++) {
+					#ifdef REMOTE_FREELIST
+					if(IS_FREELIST_EMPTY(&curBag->freelist[numBagSetItem])) {
+							drainRemoteList(curBag, numBagSetItem);
+					}
+					#endif
 
-    // Return the bag's class size in place of the object's actual size.
-		#ifdef USE_CANARY
-    return (bag->classSize - 1);
-		#else
-    return bag->classSize;
-		#endif
-    //return (bag->classSize - 1);
-  }
+					ownerLock(curBag, numBagSetItem);
+					if(!IS_FREELIST_EMPTY(&curBag->freelist[numBagSetItem])) {
+							shadowObjectInfo * shadowinfo = (shadowObjectInfo *)FREELIST_REMOVE(&curBag->freelist[numBagSetItem]);
+							ownerUnlock(curBag, numBagSetItem);
+							*fresh = false;
+							return getAddrFromShadowInfo(shadowinfo, curBag);
+					}
+					ownerUnlock(curBag, numBagSetItem);
+			}
 
-	inline bool isObjectFree(shadowObjectInfo * shadowinfo) {
-		return(shadowinfo->listentry.next != ALLOC_SENTINEL);
+			for(unsigned numBagSetItem = 0; numBagSetItem < BIBOP_BAG_SET_SIZE; numBagSetItem++) {
+					void * ptr = allocateFromBumpPointer(curBag, numBagSetItem);
+					if(ptr != NULL) {
+							*fresh = true;
+							return ptr;
+					}
+			}
+			return NULL;
 	}
 
-	void freeSmallObject(void * addr) {
+	// Records the object as being in use, and reports whether it is still
+	// zero: either fresh from the bump pointer, or released since its last use.
+	inline void * markAllocated(void * ptr, size_t sz, PerThreadBag * curBag, bool fresh, bool * zeroed) {
+		shadowObjectInfo * shadowinfo = getShadowObjectInfo(ptr, curBag);
+
+		#ifdef RELEASE_FREE_PAGES
+		if(occupyPages(ptr, curBag)) {
+			fresh = true;
+		}
+		#endif
+		if(zeroed != NULL) {
+			*zeroed = fresh;
+		}
+		#ifdef TAGGED_HEAPS
+		if(curBag->tag != 0) {
+			countTagged(curBag, 1);
+		}
+		#endif
+		shadowinfo->listentry.next = setCanary(ptr, sz, curBag);
+
+		return ptr;
+	}
+
+	#ifdef THREAD_MAGAZINE
+	// Hands out one of the objects cached in the bag's magazine, chosen at
+	// random, refilling the magazine first if it has run empty. Returns NULL
+	// if the bag has run out.
+	inline void * allocateFromMagazine(PerThreadBag * bag) {
+		if(bag->magCount == 0) {
+			refillMagazine(bag);
+			if(bag->magCount == 0) {
+				return NULL;
+			}
+		}
+
+		// xorshift32; its seed is redrawn from the RNG at every refill.
+		unsigned seed = bag->magSeed;
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		bag->magSeed = seed;
+
+		unsigned index = seed % bag->magCount;
+		void * ptr = bag->magazine[index];
+		bag->magazine[index] = bag->magazine[--bag->magCount];
+		return ptr;
+	}
+
+	// Fills the magazine from a randomly selected bag set: from its freelist
+	// under a single lock acquisition if possible, from its bump pointer otherwise.
+	void refillMagazine(PerThreadBag * bag) {
+		bool useBumpPointer;
+		unsigned randNum;
+		unsigned numBagSetItem = selectBagSet(&useBumpPointer, &randNum);
+		unsigned count = 0;
+
+		bag->magSeed = (randNum ^ getRandomNumber()) | 1;
+
+		if(!useBumpPointer) {
+			#ifdef REMOTE_FREELIST
+			if(IS_FREELIST_EMPTY(&bag->freelist[numBagSetItem])) {
+				drainRemoteList(bag, numBagSetItem);
+			}
+			#endif
+
+			ownerLock(bag, numBagSetItem);
+			while(count < MAGAZINE_DEPTH && !IS_FREELIST_EMPTY(&bag->freelist[numBagSetItem])) {
+				bag->magazine[count++] = FREELIST_REMOVE(&bag->freelist[numBagSetItem]);
+			}
+			ownerUnlock(bag, numBagSetItem);
+
+			for(unsigned i = 0; i < count; i++) {
+				bag->magazine[i] = getAddrFromShadowInfo((shadowObjectInfo *)bag->magazine[i], bag);
+			}
+		}
+
+		bag->magFresh = (count == 0);
+		if(count == 0) {
+			count = allocateRunFromBumpPointer(bag, numBagSetItem, bag->magazine, MAGAZINE_DEPTH);
+		}
+		if(count == 0) {
+			// Objects in the free magazine are only found on their freelists.
+			flushFreeMagazine(bag);
+			void * ptr = allocateFromAnyBagSet(bag, &bag->magFresh);
+			if(ptr != NULL) {
+				bag->magazine[count++] = ptr;
+			}
+		}
+		bag->magCount = count;
+	}
+
+	// Returns the objects still cached in the calling thread's magazines to
+	// the freelists they came from. Called when the thread exits.
+	void flushMagazines() {
+		PerThreadBag * bag;
+		#ifdef CUSTOMIZED_STACK
+		int threadIndex = getThreadIndex(&bag);
+		#else
+		int threadIndex = getThreadIndex();
+		#endif
+
+		PerThreadBag * bags = getSubHeapBags(getSubHeapIndex(threadIndex));
+		for(unsigned rowBagNum = 0; rowBagNum < BIBOP_NUM_BAGS * BIBOP_TAG_ROWS; rowBagNum++) {
+			bag = &bags[rowBagNum];
+			if(rowBagNum % BIBOP_NUM_BAGS >= _numUsableBags) {
+				continue;
+			}
+			while(bag->magCount > 0) {
+				unsigned numBagSetItem;
+				shadowObjectInfo * shadowinfo = getShadowObjectInfo(bag->magazine[--bag->magCount], &bag, &numBagSetItem);
+				ownerLock(bag, numBagSetItem);
+				FREELIST_INSERT(&shadowinfo->listentry, &bag->freelist[numBagSetItem]);
+				ownerUnlock(bag, numBagSetItem);
+			}
+			flushFreeMagazine(bag);
+		}
+	}
+
+	// Takes an object freed by the bag's owner into its free magazine, which
+	// is flushed once full. The object counts as free from now on.
+	inline void addToFreeMagazine(shadowObjectInfo * shadowinfo, PerThreadBag * bag) {
+		shadowinfo->listentry.next = NULL;
+		bag->freeMagazine[bag->freeMagCount++] = shadowinfo;
+		if(bag->freeMagCount == MAGAZINE_DEPTH) {
+			flushFreeMagazine(bag);
+		}
+	}
+
+	// Puts the objects of the free magazine back onto their freelists, taking
+	// the lock of each bag set they belong to once.
+	void flushFreeMagazine(PerThreadBag * bag) {
+		unsigned count = bag->freeMagCount;
+		while(count > 0) {
+			unsigned numBagSetItem = getHeapNumber(bag->freeMagazine[0]) & BIBOP_BAG_SET_MASK;
+			unsigned kept = 0;
+			ownerLock(bag, numBagSetItem);
+			for(unsigned i = 0; i < count; i++) {
+				shadowObjectInfo * shadowinfo = bag->freeMagazine[i];
+				if((getHeapNumber(shadowinfo) & BIBOP_BAG_SET_MASK) == numBagSetItem) {
+					FREELIST_INSERT(&shadowinfo->listentry, &bag->freelist[numBagSetItem]);
+				} else {
+					bag->freeMagazine[kept++] = shadowinfo;
+				}
+			}
+			ownerUnlock(bag, numBagSetItem);
+			count = kept;
+		}
+		bag->freeMagCount = 0;
+	}
+	#endif
+
+	inline void incrementBumpPointer(PerThreadBag * curBag, unsigned numBagSetItem) {
+			char ** position = &curBag->position[numBagSetItem];
+			char ** lastofCurBag = &curBag->lastofCurBag[numBagSetItem];
+
+			//unsigned heapNum = getHeapNumber(*position);
+			//PRDBG("thread %u bag %u set %u: heap=%u, position=%p, lastofCurBag=%p",
+			//				curBag->threadIndex, curBag->bagNum, numBagSetItem, heapNum, *position,
+			//				*lastofCurBag);
+
+			// Check whether this object is the last one on the current bag...
+			if(*position < *lastofCurBag) {
+					// We're still inside the current bag.
+					*position += curBag->classSize;
+			} else {
+					// We will now point to the next heap.
+					*position += curBag->nextHeapObjectOffset;
+					if(*position >= curBag->heapLimit) {
+							return;
+					}
+
+					#if defined(ENABLE_GUARDPAGE) && !defined(RANDOM_GUARD)
+					// set a guard page at the end of this new bag; with random guards
+					// this is done along with its first chunk, see installGuardChunk().
+					setGuardPage(*position, curBag->guardsize, curBag->guardoffset);
+					#endif
+
+					//void * oldValue = *lastofCurBag;
+					*lastofCurBag = getLastOfBag(*position, curBag);
+					//unsigned heapNum = getHeapNumber(*position);
+					//PRDBG("thread %u bag %u set %u: moved to heap number %u: bag start=%p, lastofCurBag=%p",
+					//				curBag->threadIndex, curBag->bagNum, numBagSetItem, heapNum, oldValue, *lastofCurBag);
+			}
+	}
+
+	// Whether the object at the given bump pointer position reaches into a
+	// page that none of the objects before it have touched.
+	inline bool startsNewPage(char * position, size_t classSize) {
+			return ((((uintptr_t)position - 1) >> PageSizeShiftBits) !=
+					(((uintptr_t)position + classSize - 1) >> PageSizeShiftBits));
+	}
+
+	#ifdef RANDOM_GUARD
+	// Moves the bump pointer past any guards that its object reaches into.
+	// The guards of a chunk are installed by the time the bump pointer enters
+	// it, so this only consults the chunk's guard map.
+	inline void skipRandomGuard(PerThreadBag * curBag, unsigned numBagSetItem) {
+			char ** position = &curBag->position[numBagSetItem];
+			if(*position >= curBag->heapLimit) {
+					return;
+			}
+			size_t classSize = curBag->classSize;
+			size_t unitSize = 1UL << curBag->guardUnitShift;
+
+			// The object at the bump pointer may straddle a page boundary, in
+			// which case only the page it reaches into is yet to be checked.
+			char * guardAddr = (classSize < PageSize) ? (char *)alignupPointer(*position, PageSize) : *position;
+			while(guardAddr <= *position + classSize - 1) {
+					if(guardAddr >= _heapEnd || !isRandomGuard(curBag, numBagSetItem, guardAddr)) {
+							guardAddr += unitSize;
+							continue;
+					}
+
+					// Skip every object overlapping the guard. For the purposes of
+					// incrementBumpPointer(), we want it to assume we are operating on
+					// the object immediately preceding the first one past the guard.
+					char * bagStart = _heapBegin + aligndown(*position - _heapBegin, _bibopBagSize);
+					unsigned long nextIndex = (guardAddr + unitSize - bagStart + classSize - 1) / classSize;
+					char * nextObject = bagStart + nextIndex * classSize;
+					if(nextObject > curBag->lastofCurBag[numBagSetItem]) {
+							*position = curBag->lastofCurBag[numBagSetItem];
+					} else {
+							*position = nextObject - classSize;
+					}
+					incrementBumpPointer(curBag, numBagSetItem);
+					if(*position >= curBag->heapLimit) {
+							return;
+					}
+
+					// The next guard may follow right away, so check every unit the new
+					// object touches.
+					guardAddr = (char *)aligndown((uintptr_t)*position, unitSize);
+			}
+	}
+
+	inline bool isRandomGuard(PerThreadBag * curBag, unsigned numBagSetItem, char * addr) {
+			char * chunk = _heapBegin + aligndown(addr - _heapBegin, curBag->guardChunkSize);
+			if(chunk != curBag->guardChunk[numBagSetItem]) {
+					enterGuardChunk(curBag, numBagSetItem, chunk);
+			}
+			unsigned long unit = (addr - chunk) >> curBag->guardUnitShift;
+			return (curBag->guardMap[numBagSetItem] & (1UL << unit)) != 0;
+	}
+
+	// Makes the given chunk the current one of the bag set, installing its
+	// guards unless the helper thread already has, and asks the helper for
+	// the chunks after it. A bag set's bump pointer only moves upwards.
+	void enterGuardChunk(PerThreadBag * curBag, unsigned numBagSetItem, char * chunk) {
+			curBag->guardChunk[numBagSetItem] = chunk;
+			curBag->guardMap[numBagSetItem] = getGuardChunkMap(curBag, chunk);
+
+			#ifdef GUARD_HELPER_THREAD
+			if(__atomic_load_n(&curBag->preparedChunk[numBagSetItem], __ATOMIC_ACQUIRE) < chunk) {
+					installGuardChunk(curBag, chunk);
+			}
+			char * next = chunk;
+			for(int i = 0; i < GUARD_HELPER_LOOKAHEAD; i++) {
+					next = getNextGuardChunk(curBag, next);
+					if(next == NULL) {
+							break;
+					}
+					if(next <= curBag->requestedChunk[numBagSetItem]) {
+							continue;
+					}
+					if(!requestGuardChunk(curBag, numBagSetItem, next)) {
+							break;
+					}
+					curBag->requestedChunk[numBagSetItem] = next;
+			}
+			#else
+			installGuardChunk(curBag, chunk);
+			#endif
+	}
+
+	static inline unsigned long splitmix64(unsigned long * state) {
+			unsigned long z = (*state += 0x9e3779b97f4a7c15UL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+			return z ^ (z >> 31);
+	}
+
+	// Returns which units of the chunk are guards, one bit per unit. This only
+	// depends on the chunk's address and _guardSeed, so that the allocating
+	// thread and the helper thread agree on it without sharing any state.
+	// The first unit of a bag is never a guard, as the bump pointer starts
+	// out there.
+	inline unsigned long getGuardChunkMap(PerThreadBag * bag, char * chunk) {
+			unsigned long state = _guardSeed ^ (uintptr_t)chunk;
+			unsigned numUnits = bag->guardChunkSize >> bag->guardUnitShift;
+			unsigned long map = 0;
+			for(unsigned unit = 0; unit < numUnits; unit++) {
+					if((splitmix64(&state) >> 32) < RANDOM_GUARD_CHUNK_CUTOFF) {
+							map |= 1UL << unit;
+					}
+			}
+			if(((chunk - _heapBegin) & _bagMask) == 0) {
+					map &= ~1UL;
+			}
+			return map;
+	}
+
+	// Installs the guards of the given chunk, with one call per run of adjacent
+	// guards. The first chunk of a bag also brings the guard at the bag's end.
+	// Installing a chunk twice is harmless.
+	// When guards split the heap into separate mappings and these run low,
+	// only the first run of each chunk is installed. The units of the other
+	// runs are still left unused, so the allocating thread need not know.
+	void installGuardChunk(PerThreadBag * bag, char * chunk) {
+			unsigned long map = getGuardChunkMap(bag, chunk);
+			unsigned shift = bag->guardUnitShift;
+			bool sparse = MM::guardsTakeMappings() && (MM::guardPressure() != GUARD_PRESSURE_NONE);
+			bool installed = false;
+			while(map != 0) {
+					unsigned first = __builtin_ctzl(map);
+					unsigned long rest = ~(map >> first);
+					unsigned length = (rest == 0) ? (64 - first) : __builtin_ctzl(rest);
+					if(sparse && installed) {
+							MM::guardSkipped(1);
+					} else {
+							MM::guardInstall(chunk + ((size_t)first << shift), (size_t)length << shift);
+							installed = true;
+					}
+					map = (first + length == 64) ? 0 : (map & ~(((1UL << length) - 1) << first));
+			}
+
+			#ifdef ENABLE_GUARDPAGE
+			if(((chunk - _heapBegin) & _bagMask) == 0) {
+					setGuardPage(chunk, bag->guardsize, bag->guardoffset);
+			}
+			#endif
+	}
+
+	#ifdef GUARD_HELPER_THREAD
+	// Returns the chunk the bump pointer of the bag set enters after the
+	// given one, which may be the first chunk of the bag in the next heap, or
+	// NULL if the bag set runs out before that.
+	inline char * getNextGuardChunk(PerThreadBag * bag, char * chunk) {
+			char * bagStart = _heapBegin + aligndown(chunk - _heapBegin, _bibopBagSize);
+			char * next = chunk + bag->guardChunkSize;
+			if(next > getLastOfBag(bagStart, bag)) {
+					next = bagStart + BIBOP_HEAP_SIZE * BIBOP_BAG_SET_SIZE;
+					if(next >= bag->heapLimit) {
+							return NULL;
+					}
+			}
+			return next;
+	}
+
+	// Starts the thread installing guards ahead of the bump pointers. It never
+	// allocates, and runs with all signals blocked.
+	void startGuardHelper() {
+			pthread_spin_init(&_guardRequestLock, PTHREAD_PROCESS_PRIVATE);
+
+			sigset_t allSignals, oldSignals;
+			sigfillset(&allSignals);
+			pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+			pthread_t helper;
+			int result = Real::pthread_create(&helper, NULL, guardHelperThread, NULL);
+			pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+			if(result != 0) {
+					PRERR("Failed to start the guard helper thread: %s", strerror(result));
+					return;
+			}
+			_guardHelperRunning = true;
+			pthread_atfork(NULL, NULL, guardHelperAfterFork);
+	}
+
+	// The helper does not survive fork(); the child installs all guards itself.
+	static void guardHelperAfterFork() {
+			BibopHeap & heap = getInstance();
+			heap._guardHelperRunning = false;
+			heap._guardRequestHead = heap._guardRequestTail = 0;
+			pthread_spin_init(&heap._guardRequestLock, PTHREAD_PROCESS_PRIVATE);
+	}
+
+	static void * guardHelperThread(void *) {
+			getInstance().runGuardHelper();
+			return NULL;
+	}
+
+	void runGuardHelper() {
+			struct timespec pollInterval = { 0, GUARD_HELPER_POLL_NS };
+			unsigned idlePolls = 0;
+			guardRequest request;
+			while(true) {
+					if(takeGuardRequest(&request)) {
+							installGuardChunk(request.bag, request.chunk);
+							__atomic_store_n(&request.bag->preparedChunk[request.numBagSetItem], request.chunk, __ATOMIC_RELEASE);
+							idlePolls = 0;
+					} else if(idlePolls < GUARD_HELPER_IDLE_POLLS) {
+							// While allocation is under way, requests are picked up by polling
+							// so that handing them over costs the allocating threads no system call.
+							nanosleep(&pollInterval, NULL);
+							idlePolls++;
+					} else {
+							__atomic_store_n(&_guardHelperWaiting, 1, __ATOMIC_SEQ_CST);
+							if(!hasGuardRequest()) {
+									syscall(SYS_futex, &_guardHelperWaiting, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+							}
+							__atomic_store_n(&_guardHelperWaiting, 0, __ATOMIC_SEQ_CST);
+							idlePolls = 0;
+					}
+			}
+	}
+
+	// Queues the chunk for the helper, returning false if it cannot take it;
+	// the chunk is then installed by the allocating thread once it gets there.
+	bool requestGuardChunk(PerThreadBag * bag, unsigned numBagSetItem, char * chunk) {
+			if(!_guardHelperRunning || chunk >= _heapEnd) {
+					return false;
+			}
+
+			bool queued = false;
+			pthread_spin_lock(&_guardRequestLock);
+			if(_guardRequestTail - _guardRequestHead < GUARD_REQUEST_QUEUE_SIZE) {
+					guardRequest * request = &_guardRequests[_guardRequestTail++ % GUARD_REQUEST_QUEUE_SIZE];
+					request->bag = bag;
+					request->numBagSetItem = numBagSetItem;
+					request->chunk = chunk;
+					queued = true;
+			}
+			pthread_spin_unlock(&_guardRequestLock);
+
+			// Only a helper that has gone to sleep after a quiet period needs waking.
+			if(__atomic_load_n(&_guardHelperWaiting, __ATOMIC_SEQ_CST)) {
+					__atomic_store_n(&_guardHelperWaiting, 0, __ATOMIC_SEQ_CST);
+					syscall(SYS_futex, &_guardHelperWaiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+			}
+			return queued;
+	}
+
+	bool takeGuardRequest(guardRequest * request) {
+			bool found = false;
+			pthread_spin_lock(&_guardRequestLock);
+			if(_guardRequestHead != _guardRequestTail) {
+					*request = _guardRequests[_guardRequestHead++ % GUARD_REQUEST_QUEUE_SIZE];
+					found = true;
+			}
+			pthread_spin_unlock(&_guardRequestLock);
+			return found;
+	}
+
+	bool hasGuardRequest() {
+			pthread_spin_lock(&_guardRequestLock);
+			bool found = (_guardRequestHead != _guardRequestTail);
+			pthread_spin_unlock(&_guardRequestLock);
+			return found;
+	}
+	#endif
+	#endif
+
+  size_t getObjectSize(void * addr) {
+    if(isInvalidAddr(addr)) {
+      return -1;
+    }
+
+    PerThreadBag *bag;
+    shadowObjectInfo * shadowinfo = getShadowObjectInfo(addr, &bag);
+
+    // Return the bag's class size (less the canary) in place of the object's actual size.
+    return getUsableSize(shadowinfo, bag);
+  }
+
+	inline bool isObjectFree(shadowObjectInfo * shadowinfo) {
+		return(((uintptr_t)shadowinfo->listentry.next & ALLOC_SENTINEL_TAG) == 0);
+	}
+
+	// Whether the object is in use and carries an in-line canary.
+	inline bool hasCanary(shadowObjectInfo * shadowinfo) {
+		#ifdef USE_CANARY
+		return(shadowinfo->listentry.next == ALLOC_SENTINEL);
+		#else
+		return false;
+		#endif
+	}
+
+	inline size_t getUsableSize(shadowObjectInfo * shadowinfo, PerThreadBag * bag) {
+		return(hasCanary(shadowinfo) ? (bag->classSize - 1) : bag->classSize);
+	}
+
+	void freeSmallObject(void * addr) {
 		unsigned numBagSetItem;
 		PerThreadBag *bag;
 		shadowObjectInfo * shadowinfo = getShadowObjectInfo(addr, &bag, &numBagSetItem);
@@ -513,102 +1482,435 @@ public:
 		//PRDBG("thread %u bag %u set %u freeing object %p ~ %p",
 		//	bag->threadIndex, bag->bagNum, numBagSetItem, addr, addrEnd);
 
+		checkFreedObject(addr, shadowinfo, bag);
+		insertFreedObject(shadowinfo, bag, numBagSetItem);
+	}
+
+	// Frees an object the caller says is of the given class. The class is
+	// checked against the address while the object is located, so the object
+	// is looked up once. Returns false, freeing nothing, on a mismatch.
+	inline bool freeSmallObjectOfClass(void * addr, unsigned bagNum) {
+		unsigned long offset = (char *)addr - _heapBegin;
+		unsigned long globalBagNum = offset >> _bagShiftBits;
+		if((globalBagNum & (BIBOP_NUM_BAGS - 1)) != bagNum) {
+			return false;
+		}
+
+		unsigned long localBagOffset = offset & _bagMask;
+		unsigned long heapIndex = globalBagNum >> _numBagsPerHeapShiftBits;
+		PerThreadBag * bag = &getSubHeapBags((offset & _heapMask) >> _threadShiftBits)[getRowBagNum(globalBagNum, heapIndex)];
+		unsigned long objectIndex = getObjectIndex(localBagOffset, bag);
+		if(objectIndex * bag->classSize != localBagOffset) {
+			PRERR("Invalid object: addr %p, classSize 0x%lx, offset 0x%lx",
+						addr, bag->classSize, localBagOffset);
+      printCallStack();
+      exit(EXIT_FAILURE);
+		}
+		shadowObjectInfo * shadowinfo = (shadowObjectInfo *)(_shadowMemBegin + (heapIndex << _shadowMemSizePerHeapCeilShiftBits) + bag->startShadowMemOffset) + objectIndex;
+
+		#if (BIBOP_BAG_SET_SIZE <= 1)
+		unsigned numBagSetItem = 0;
+		#else
+		unsigned numBagSetItem = heapIndex & BIBOP_BAG_SET_MASK;
+		#endif
+
+		checkFreedObject(addr, shadowinfo, bag);
+		insertFreedObject(shadowinfo, bag, numBagSetItem);
+		return true;
+	}
+
+	// Returns a checked object to its bag set's freelist, or to the owner's
+	// remote list.
+	inline void insertFreedObject(shadowObjectInfo * shadowinfo, PerThreadBag * bag, unsigned numBagSetItem) {
+		#if defined(REMOTE_FREELIST) || defined(THREAD_MAGAZINE)
+		#ifdef CUSTOMIZED_STACK
+		unsigned threadIndex = getThreadIndex(&bag);
+		#else
+		unsigned threadIndex = getThreadIndex();
+		#endif
+		#endif
+
+		#ifdef THREAD_MAGAZINE
+		if(bag->threadIndex == threadIndex && bag->classSize <= MAGAZINE_MAX_CLASS_SIZE) {
+			addToFreeMagazine(shadowinfo, bag);
+			return;
+		}
+		#endif
+
+		#ifdef REMOTE_FREELIST
+		if(bag->threadIndex == threadIndex) {
+			FREELIST_INSERT(&shadowinfo->listentry, &bag->freelist[numBagSetItem]);
+		} else if(bag->shared) {
+			lock(bag, numBagSetItem);
+			FREELIST_INSERT(&shadowinfo->listentry, &bag->freelist[numBagSetItem]);
+			unlock(bag, numBagSetItem);
+		} else {
+			#ifdef CFREELIST
+			queueRemoteFree(&shadowinfo->listentry, &bag->remotelist[numBagSetItem]);
+			#else
+			atomicInsertSLLHead(&shadowinfo->listentry, &bag->remotelist[numBagSetItem]);
+			#endif
+		}
+		#else
+		lock(bag, numBagSetItem);
+		FREELIST_INSERT(&shadowinfo->listentry, &bag->freelist[numBagSetItem]);
+		unlock(bag, numBagSetItem);
+		#endif
+	}
+
+	// Checks an object being freed, and fails on double frees and damaged
+	// canaries, before it is destroyed and its pages vacated as configured.
+	inline void checkFreedObject(void * addr, shadowObjectInfo * shadowinfo, PerThreadBag * bag) {
 		if(isObjectFree(shadowinfo)) {
 			PRERR("Double free or invalid free problem found on object %p (sm %p)", addr, shadowinfo);
       printCallStack();
       exit(EXIT_FAILURE);
-		} else {
-				#ifdef DESTROY_ON_FREE
-				#ifdef USE_CANARY
-				size_t objectSizeWoCanary = bag->classSize - 1;
-				#else
-				size_t objectSizeWoCanary = bag->classSize;
-				#endif
-				#endif
+		}
 
-				#ifdef USE_CANARY
-				char * canary = (char *)addr + bag->classSize - 1;
-				if(*canary != CANARY_SENTINEL) {
-						FATAL("canary value for object %p not intact; canary @ %p, value=0x%x",
-										addr, canary, *canary);
-				}
-				#if (NUM_MORE_CANARIES_TO_CHECK > 0)
-				for(int move = LEFT; move <= RIGHT; move++) {
-						shadowObjectInfo * canaryShadow = shadowinfo;
-						for(int pos = 0; pos < NUM_MORE_CANARIES_TO_CHECK; pos++) {
-								if((canaryShadow = getNextCanaryNeighbor(canaryShadow, bag, (direction)move))) {
-										char * neighborAddr = (char *)getAddrFromShadowInfo(canaryShadow, bag);
-										char * canary = neighborAddr + bag->classSize - 1;
-										// We will only inspect the canary of objects currently in-use; if the
-										// object is free, then it has already been checked previously.
-										if(!isObjectFree(canaryShadow) && (*canary != CANARY_SENTINEL)) {
-												FATAL("canary value for object %p (neighbor of %p) not intact; canary @ %p, value=0x%x",
-																neighborAddr, addr, canary, *canary);
-										}
-								} else {
-										// getNextCanaryNeighbor will only return null when we attempt to move
-										// left from the first object in a bag within a heap that is less
-										// than BIBOP_BAG_SET_SIZE. This indicates there are no previous heaps
-										// we can move to. In this case, simply stop trying to move left.
-										break;
+		#ifdef DESTROY_ON_FREE
+		size_t objectSizeWoCanary = getUsableSize(shadowinfo, bag);
+		#endif
+
+		#ifdef USE_CANARY
+		char * canary = (char *)addr + bag->classSize - 1;
+		if(hasCanary(shadowinfo) && (*canary != CANARY_SENTINEL)) {
+				FATAL("canary value for object %p not intact; canary @ %p, value=0x%x",
+								addr, canary, *canary);
+		}
+		checkOutOfLineCanary((char *)addr, shadowinfo, bag, addr);
+		#if (NUM_MORE_CANARIES_TO_CHECK > 0)
+		for(int move = LEFT; move <= RIGHT; move++) {
+				shadowObjectInfo * canaryShadow = shadowinfo;
+				for(int pos = 0; pos < NUM_MORE_CANARIES_TO_CHECK; pos++) {
+						if((canaryShadow = getNextCanaryNeighbor(canaryShadow, bag, (direction)move))) {
+								char * neighborAddr = (char *)getAddrFromShadowInfo(canaryShadow, bag);
+								char * canary = neighborAddr + bag->classSize - 1;
+								// We will only inspect the canary of objects currently in-use; if the
+								// object is free, then it has already been checked previously.
+								// Exact-fit neighbors have no canary to inspect.
+								if(hasCanary(canaryShadow) && (*canary != CANARY_SENTINEL)) {
+										FATAL("canary value for object %p (neighbor of %p) not intact; canary @ %p, value=0x%x",
+														neighborAddr, addr, canary, *canary);
 								}
+								checkOutOfLineCanary(neighborAddr, canaryShadow, bag, addr);
+						} else {
+								// getNextCanaryNeighbor will only return null when we attempt to move
+								// left from the first object in a bag within one of the first
+								// BIBOP_BAG_SET_SIZE heaps of its row, or right from the last object
+								// in one of the last heaps. This indicates there are no more heaps we
+								// can move to. In this case, simply stop trying to move this way.
+								break;
 						}
 				}
-			#endif
-			#endif
-			#ifdef DESTROY_ON_FREE
-			destroyObject(addr, objectSizeWoCanary);
-			#endif
+		}
+		#endif
+		#endif
+		#ifdef DESTROY_ON_FREE
+		destroyObject(addr, objectSizeWoCanary);
+		#endif
+		#ifdef USE_CANARY
+		// The out-of-line canary of the object before this one, see
+		// checkOutOfLineCanary(). It must be in place before the object is seen
+		// to be free.
+		*(char *)addr = CANARY_SENTINEL;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		#endif
+		#ifdef RELEASE_FREE_PAGES
+		vacatePages(addr, bag);
+		#endif
+		#ifdef TAGGED_HEAPS
+		if(bag->tag != 0) {
+			countTagged(bag, -1);
+		}
+		#endif
+	}
 
-			#ifdef CFREELIST
-			#ifdef CUSTOMIZED_STACK
-			int threadIndex = getThreadIndex(&bag);
+	// Frees up to BATCH_FREE_WINDOW objects at once. Every object is checked as
+	// by freeSmallObject(), then the objects are put on their freelists with a
+	// single lock acquisition per bag set.
+	void freeSmallObjectBatch(void ** objects, unsigned count) {
+		freedObject freed[BATCH_FREE_WINDOW];
+		for(unsigned i = 0; i < count; i++) {
+			freed[i].shadowinfo = getShadowObjectInfo(objects[i], &freed[i].bag, &freed[i].numBagSetItem);
+			checkFreedObject(objects[i], freed[i].shadowinfo, freed[i].bag);
+			// Marks the object free until it is listed, so that it cannot appear
+			// twice in the batch.
+			freed[i].shadowinfo->listentry.next = NULL;
+		}
+
+		#ifdef REMOTE_FREELIST
+		PerThreadBag * anyBag;
+		#ifdef CUSTOMIZED_STACK
+		unsigned threadIndex = getThreadIndex(&anyBag);
+		#else
+		unsigned threadIndex = getThreadIndex();
+		#endif
+		#endif
+
+		for(unsigned i = 0; i < count; i++) {
+			PerThreadBag * bag = freed[i].bag;
+			unsigned numBagSetItem = freed[i].numBagSetItem;
+			if(bag == NULL) {
+				continue;
+			}
+
+			#ifdef REMOTE_FREELIST
+			if(bag->threadIndex != threadIndex && !bag->shared) {
+				#ifdef CFREELIST
+				queueRemoteFree(&freed[i].shadowinfo->listentry, &bag->remotelist[numBagSetItem]);
+				#else
+				atomicInsertSLLHead(&freed[i].shadowinfo->listentry, &bag->remotelist[numBagSetItem]);
+				#endif
+				continue;
+			}
+			bool locked = (bag->threadIndex != threadIndex);
 			#else
-			int threadIndex = getThreadIndex();
+			bool locked = true;
 			#endif
 
-			if(bag->threadIndex == threadIndex) {
-				// Add the current object directly into my own freelist.
-				FREELIST_INSERT(&shadowinfo->listentry, &bag->freelist[numBagSetItem]);
-			} else {
+			if(locked) {
 				lock(bag, numBagSetItem);
-				// Add the current object into the thread's cached free list.
-				#if (BIBOP_BAG_SET_SIZE > 1)
-				#warning there is a known bug with using the cached freelist (CFREELIST) \
-					feature; each bag set must have its own cached freelist, rather than \
-					sharing a single list between multiple bag sets. If CFREELIST is combined \
-					with a value of BIBOP_BAG_SET_SIZE > 1, a race condition will exist that \
-					causes different threads freeing objects to this bag to each attempt to \
-					manipulate the cached freelist concurrently, causing corruption of the list \
-					and resulting in segfault. We must either never use these features together, \
-					or add support for multiple cached freelists per bag.  -- SAS
-				#endif
-				insertSLLHead(&shadowinfo->listentry, &bag->cfreelist);
-				bag->ncfree++;
-				if(bag->ncfree > bag->cflthreshold) {
-						realFreeCurrentList(bag, numBagSetItem);
+			}
+			for(unsigned j = i; j < count; j++) {
+				if(freed[j].bag == bag && freed[j].numBagSetItem == numBagSetItem) {
+					FREELIST_INSERT(&freed[j].shadowinfo->listentry, &bag->freelist[numBagSetItem]);
+					freed[j].bag = NULL;
 				}
-				unlock(bag, numBagSetItem); 
 			}
-			#else
-			lock(bag, numBagSetItem);
-			FREELIST_INSERT(&shadowinfo->listentry, &bag->freelist[numBagSetItem]);
-			unlock(bag, numBagSetItem);
-			#endif
+			if(locked) {
+				unlock(bag, numBagSetItem);
+			}
+		}
+	}
+
+	// Frees an object whose size, and alignment if it was allocated aligned,
+	// the caller knows. These must give the class the object came from.
+	void freeSizedSmallObject(void * addr, size_t sz, size_t alignment = 1) {
+		int bagNum = getSizeClass(sz, alignment);
+		if(bagNum < 0 || !freeSmallObjectOfClass(addr, bagNum)) {
+			PRERR("Size %zu given for object %p does not match its class", sz, addr);
+      printCallStack();
+      exit(EXIT_FAILURE);
+		}
+	}
+
+	// Returns the class serving objects of the given size and alignment, or -1
+	// if there is none.
+	int getSizeClass(size_t sz, size_t alignment) {
+		if(alignment <= BIBOP_MIN_BLOCK_SIZE) {
+			return getBagNum(sz);
+		}
+		return getAlignedBagNum(sz, alignment);
+	}
+
+	// Whether a small object is of the class serving sz bytes.
+	bool isOfClass(void * addr, size_t sz) {
+		return getBagNumOfObject(addr) == getBagNum(sz);
+	}
+
+	// Allocates an object of sz bytes from the given class, which is checked to
+	// exist and to fit sz bytes.
+	void * allocateFromClass(unsigned bagNum, size_t sz) {
+		if(bagNum >= _numUsableBags || sz > _classSizes[bagNum] - CANARY_ROOM) {
+			PRERR("Class %d cannot serve an object of %zu bytes", (int)bagNum, sz);
+      printCallStack();
+      exit(EXIT_FAILURE);
 		}
+		return allocateFromBag(sz, bagNum, NULL);
+	}
 
-		return;
+	// Frees an object allocated from the given class, which is checked against
+	// the object's address.
+	void freeClassObject(void * addr, unsigned bagNum) {
+		if(!isSmallObject(addr) || !freeSmallObjectOfClass(addr, bagNum)) {
+			PRERR("Object %p was not allocated from class %u", addr, bagNum);
+      printCallStack();
+      exit(EXIT_FAILURE);
+		}
 	}
 
 	bool isSmallObject(void * addr) {
 		return ((char *)addr >= _heapBegin && (char *)addr <= _heapEnd);
 	}
 
+	#ifdef RELEASE_FREE_PAGES
+	// Releases the pages still queued by the calling thread. Called when the
+	// thread exits.
+	void flushPageReleases() {
+		releaseQueuedPages();
+	}
+	#endif
+
+	#ifdef CFREELIST
+	// Hands all objects the calling thread still holds for other threads'
+	// bag sets over to their owners. Called when the thread exits.
+	void flushRemoteFrees() {
+		for(int i = 0; i < REMOTE_FREE_SLOTS; i++) {
+			flushRemoteFreeBatch(&_remoteFreeBatches[i]);
+		}
+	}
+	#endif
+
 
 private:
 	inline void lock(PerThreadBag *bag, unsigned numBagSetItem) { pthread_spin_lock(&bag->listlock[numBagSetItem]); }
 	inline void unlock(PerThreadBag *bag, unsigned numBagSetItem) { pthread_spin_unlock(&bag->listlock[numBagSetItem]); }
 
+	// Protect the freelist operations performed by the thread owning the bag.
+	// With REMOTE_FREELIST no other thread touches the freelist of a
+	// dedicated bag, so none is needed.
+	inline void ownerLock(PerThreadBag *bag, unsigned numBagSetItem) {
+		#ifdef REMOTE_FREELIST
+		if(!bag->shared) {
+			return;
+		}
+		#endif
+		lock(bag, numBagSetItem);
+	}
+	inline void ownerUnlock(PerThreadBag *bag, unsigned numBagSetItem) {
+		#ifdef REMOTE_FREELIST
+		if(!bag->shared) {
+			return;
+		}
+		#endif
+		unlock(bag, numBagSetItem);
+	}
+
+	#ifdef REMOTE_FREELIST
+	// Moves all remotely freed objects of a bag set onto its freelist. In FIFO
+	// mode the merge reverses the LIFO remote list, preserving the free order.
+	inline void drainRemoteList(PerThreadBag *bag, unsigned numBagSetItem) {
+		if(isSLLEmpty(&bag->remotelist[numBagSetItem])) {
+			return;
+		}
+		slist_t remote;
+		remote.next = atomicRemoveAllSLL(&bag->remotelist[numBagSetItem]);
+		if(remote.next) {
+			FREELIST_MERGE(&remote, &bag->freelist[numBagSetItem]);
+		}
+	}
+	#endif
+
+	#ifdef CFREELIST
+	// Adds an object to the calling thread's batch for the given remote list,
+	// which is pushed with a single atomic operation once it is full. A batch
+	// whose slot is claimed by another remote list is pushed early.
+	inline void queueRemoteFree(slist_t * entry, slist_t * remotelist) {
+		unsigned slot = ((uintptr_t)remotelist * 0x9E3779B97F4A7C15UL) >> (64 - REMOTE_FREE_SLOTS_SHIFT);
+		remoteFreeBatch * batch = &_remoteFreeBatches[slot];
+
+		if(batch->target != remotelist) {
+			flushRemoteFreeBatch(batch);
+			batch->target = remotelist;
+		}
+		if(batch->count == 0) {
+			batch->tail = entry;
+		}
+		entry->next = batch->head;
+		batch->head = entry;
+
+		if(++batch->count == REMOTE_FREE_BATCH) {
+			flushRemoteFreeBatch(batch);
+		}
+	}
+
+	inline void flushRemoteFreeBatch(remoteFreeBatch * batch) {
+		if(batch->count == 0) {
+			return;
+		}
+		atomicInsertAllSLLHead(batch->head, batch->tail, batch->target);
+		batch->head = NULL;
+		batch->count = 0;
+	}
+	#endif
+
+	#ifdef RELEASE_FREE_PAGES
+	/*
+	 * Pages are released in units: a unit is a single page for classes smaller
+	 * than a page, whose objects may share (and, for classes that are not a
+	 * power of two, straddle) pages, and the whole object otherwise. Each unit
+	 * is tracked by the counter of its first page. Freelist entries live in
+	 * shadow memory, so a released unit holds nothing the allocator needs, and
+	 * reusing one of its objects simply refaults a zero page.
+	 */
+	inline unsigned short * getPageCounter(void * addr) {
+		return &_pageOccupancy[((char *)addr - _heapBegin) >> PageSizeShiftBits];
+	}
+
+	// Marks the units touched by a newly allocated object as occupied. Must
+	// happen before the object is written to: if one of them is being released
+	// at the moment, we wait until the release is complete. Returns whether
+	// all of them were released after they were last written to.
+	inline bool occupyPages(void * ptr, PerThreadBag * bag) {
+		char * unit = (char *)aligndown((uintptr_t)ptr, PageSize);
+		char * lastUnit = (bag->classSize < PageSize) ? ((char *)ptr + bag->classSize - 1) : unit;
+		bool released = true;
+		for(; unit <= lastUnit; unit += PageSize) {
+			unsigned short * counter = getPageCounter(unit);
+			unsigned short state = __atomic_fetch_add(counter, 1, __ATOMIC_ACQUIRE);
+			if(state & PAGE_RELEASING) {
+				while(__atomic_load_n(counter, __ATOMIC_ACQUIRE) & PAGE_RELEASING) {
+					__builtin_ia32_pause();
+				}
+				state = PAGE_RELEASED;
+			}
+			// Other objects of the unit may be written to from here on.
+			if(state & PAGE_RELEASED) {
+				__atomic_fetch_and(counter, (unsigned short)~PAGE_RELEASED, __ATOMIC_RELAXED);
+			} else {
+				released = false;
+			}
+		}
+		return released;
+	}
+
+	// Drops the occupancy of the units touched by an object being freed, and
+	// queues those that became empty for release.
+	inline void vacatePages(void * addr, PerThreadBag * bag) {
+		char * unit = (char *)aligndown((uintptr_t)addr, PageSize);
+		char * lastUnit = (bag->classSize < PageSize) ? ((char *)addr + bag->classSize - 1) : unit;
+		size_t unitSize = (bag->classSize < PageSize) ? PageSize : bag->classSize;
+		for(; unit <= lastUnit; unit += PageSize) {
+			unsigned short * counter = getPageCounter(unit);
+			unsigned short value = __atomic_sub_fetch(counter, 1, __ATOMIC_RELEASE);
+			// A unit that is already queued will be re-examined when its queue is released.
+			if(value == 0 && __atomic_compare_exchange_n(counter, &value, PAGE_QUEUED, false,
+								__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				queuePageRelease(unit, unitSize);
+			}
+		}
+	}
+
+	inline void queuePageRelease(char * unit, size_t length) {
+		pageReleaseQueue * queue = &_pageReleaseQueue;
+		queue->entries[queue->numEntries].addr = unit;
+		queue->entries[queue->numEntries].length = length;
+		if(++queue->numEntries == PAGE_RELEASE_BATCH) {
+			releaseQueuedPages();
+		}
+	}
+
+	// Releases every queued unit that is still empty. A unit that was reused
+	// in the meantime is only dequeued; it is queued again once it empties.
+	void releaseQueuedPages() {
+		pageReleaseQueue * queue = &_pageReleaseQueue;
+		for(unsigned i = 0; i < queue->numEntries; i++) {
+			unsigned short * counter = getPageCounter(queue->entries[i].addr);
+			unsigned short expected = PAGE_QUEUED;
+			if(__atomic_compare_exchange_n(counter, &expected, PAGE_RELEASING, false,
+								__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				madvise(queue->entries[i].addr, queue->entries[i].length, PAGE_RELEASE_ADVICE);
+				// Clears PAGE_RELEASING and sets PAGE_RELEASED, keeping the count of
+				// those waiting to occupy the unit.
+				__atomic_fetch_add(counter, (unsigned short)(PAGE_RELEASED - PAGE_RELEASING), __ATOMIC_RELEASE);
+			} else {
+				__atomic_fetch_and(counter, (unsigned short)~PAGE_QUEUED, __ATOMIC_RELAXED);
+			}
+		}
+		queue->numEntries = 0;
+	}
+	#endif
+
 	#ifdef DESTROY_ON_FREE
 	inline void destroyObject(void * addr, size_t classSize) {
 			#warning destroy-on-free only applies to objects <= 2KB in size
@@ -618,25 +1920,55 @@ private:
 	}
 	#endif
 
-	inline int getRandomNumber() {
-		int retVal;
-
-    #ifdef SSE2RNG
-    #warning using sse2rng routine rather than libc rand
-    unsigned randNum[4];
-    rand_sse(randNum);
-		retVal = randNum[0];
-    #elif ARC4RNG
-    #warning using arc4rng routine rather than libc rand
-    retVal = arc4random_uniform(RAND_MAX);
-    #else
-    #warning using libc random number generator
-    retVal = rand();
-    #endif
+	// Returns 32 random bits.
+	inline unsigned getRandomNumber() {
+		return rngNext();
+	}
 
-		return retVal;
+	// Writes the canary into the slack of the object's class, if there is any,
+	// and returns the matching allocation tag for its shadow entry.
+	inline slist_t * setCanary(void * ptr, size_t sz, PerThreadBag * bag) {
+		#ifdef USE_CANARY
+		if(sz >= bag->classSize) {
+			return ALLOC_SENTINEL_NOCANARY;
+		}
+		char * canary = (char *)ptr + bag->classSize - 1;
+		*canary = CANARY_SENTINEL;
+		#endif
+		return ALLOC_SENTINEL;
 	}
 
+	#ifdef USE_CANARY
+	// Objects that fill their class exactly have no room for a canary. Theirs
+	// is kept out of line, in the first byte of the next object while that one
+	// is free: freed objects hold CANARY_SENTINEL there, and objects never
+	// handed out are still zero. Only a next object on the same page as the
+	// end of this one is inspected, so that guards are never touched.
+	inline void checkOutOfLineCanary(char * addr, shadowObjectInfo * shadowinfo, PerThreadBag * bag, void * freedAddr) {
+			if(shadowinfo->listentry.next != ALLOC_SENTINEL_NOCANARY) {
+					return;
+			}
+			char * next = addr + bag->classSize;
+			unsigned long objectIndex = getObjectIndex((addr - _heapBegin) & _bagMask, bag);
+			if(((uintptr_t)next & PageMask) == 0 || objectIndex >= bag->lastObjectIndex) {
+					return;
+			}
+
+			// The next object may be handed out and written meanwhile, in which
+			// case its shadow entry has changed by the time its byte is read.
+			slist_t ** nextEntry = &(shadowinfo + 1)->listentry.next;
+			slist_t * entry = __atomic_load_n(nextEntry, __ATOMIC_ACQUIRE);
+			if(((uintptr_t)entry & ALLOC_SENTINEL_TAG) != 0) {
+					return;
+			}
+			char value = __atomic_load_n(next, __ATOMIC_ACQUIRE);
+			if(value != 0 && value != CANARY_SENTINEL && __atomic_load_n(nextEntry, __ATOMIC_ACQUIRE) == entry) {
+					FATAL("out-of-line canary for object %p (freeing %p) not intact; canary @ %p, value=0x%x",
+									addr, freedAddr, next, value);
+			}
+	}
+	#endif
+
 	inline shadowObjectInfo * getNextCanaryNeighbor(shadowObjectInfo * shadowinfo, PerThreadBag * bag, direction move) {
 			unsigned heapNum = getHeapNumber(shadowinfo);
 			ptrdiff_t shadowOffset = (char *)shadowinfo - _shadowMemBegin;
@@ -649,7 +1981,7 @@ private:
 			if(move == LEFT) {
 					if(objectindex == 0) {
 							// Check whether we are physically capable of moving to the left; if not, return null
-							if(heapNum < BIBOP_BAG_SET_SIZE) {
+							if(heapNum < bag->firstHeap + BIBOP_BAG_SET_SIZE) {
 									//PRDBG("thread %u bag %u: no more canary neighbors to check; sm %p in heap %u",
 									//				bag->threadIndex, bag->bagNum, shadowinfo, heapNum);
 									return NULL;
@@ -666,6 +1998,11 @@ private:
 			} else {
 					// Check to see if we reached the index of the last object in this bag
 					if(objectindex == bag->lastObjectIndex) {
+							// There is no next heap past the last ones of the bag's row
+							if(heapNum + BIBOP_BAG_SET_SIZE >= bag->endHeap) {
+									return NULL;
+							}
+
 							// We must move to the first object in the next heap
 							//shadowObjectInfo * shadowinfoOld = shadowinfo;
 							shadowinfo = (shadowObjectInfo *)((char *)shadowinfo + bag->nextShadowHeapObjectOffset);
@@ -679,14 +2016,52 @@ private:
 			return shadowinfo;
 	}
 
-	inline char * getLastOfBag(char * start, size_t guardoffset, size_t classSize) {
-			return start + _bibopBagSize - guardoffset - classSize;
+	inline char * getLastOfBag(char * start, PerThreadBag * bag) {
+			return start + bag->lastObjectIndex * bag->classSize;
 	}
 
-	inline unsigned int getBagNum(size_t classSize) {
-		return LOG2(classSize) - _firstBagPower;
+	inline unsigned long getBagNumOfObject(void * addr) {
+		return (((char *)addr - _heapBegin) >> _bagShiftBits) & (BIBOP_NUM_BAGS - 1);
+	}
+
+	#ifdef TAGGED_HEAPS
+	// Counts objects of a tagged bag coming into or going out of use. The
+	// counters share the bag's cache line, so owners rarely contend on them.
+	inline void countTagged(PerThreadBag * bag, long objects) {
+		__atomic_add_fetch(&bag->liveBytes, objects * bag->classSize, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&bag->liveObjects, objects, __ATOMIC_RELAXED);
+	}
+	#endif
+
+	// Returns the class serving requests of sz bytes, making room for the
+	// canary unless it only goes into slack.
+	inline unsigned int getBagNum(size_t sz) {
+		sz += CANARY_ROOM;
+		if(sz <= BIBOP_CLASS_LOOKUP_MAX) {
+			return _sizeClassLookup[(sz + BIBOP_MIN_BLOCK_SIZE - 1) / BIBOP_MIN_BLOCK_SIZE];
+		}
+		return _lookupMaxBag + (64 - __builtin_clzl(sz - 1)) - LOG2(BIBOP_CLASS_LOOKUP_MAX);
 	}	
 
+	// Divides an offset within a bag by the bag's class size. The result is
+	// exact whenever bagOffset is a multiple of the class size, which is all
+	// that callers rely upon (and check, in the case of external pointers).
+	inline unsigned long getObjectIndex(unsigned long bagOffset, PerThreadBag * bag) {
+		return (bagOffset * bag->classMagic) >> BIBOP_CLASS_MAGIC_SHIFT_BITS;
+	}
+
+	// Returns the index of the bag among the bags of its subheap, whose row
+	// follows from the heap it is in.
+	inline unsigned long getRowBagNum(unsigned long globalBagNum, unsigned long heapIndex) {
+		unsigned long rowBagNum = globalBagNum & _numBagsPerSubHeapMask;
+		#ifdef TAGGED_HEAPS
+		if(heapIndex >= _numUntaggedHeaps) {
+			rowBagNum += (1 + ((heapIndex - _numUntaggedHeaps) >> _tagHeapsShiftBits)) * BIBOP_NUM_BAGS;
+		}
+		#endif
+		return rowBagNum;
+	}
+
 	inline unsigned getHeapNumber(shadowObjectInfo * shadowinfo) {
 		ptrdiff_t shadowOffset = (char *)shadowinfo - _shadowMemBegin;
 		unsigned heapIndex = shadowOffset >> _shadowMemSizePerHeapCeilShiftBits;
@@ -721,13 +2096,14 @@ private:
 		//	addr, _heapBegin, offset, localHeapOffset, localBagOffset, globalBagNum, heapIndex, _heapMask, _bagMask, _numBagsPerHeapShiftBits, _numBagsPerSubHeapMask, (globalBagNum & _numBagsPerSubHeapMask));
 
 		// Now we will locate the PerThreadBag based on the bag number and heap offset.
-		*bag = &_threadBag[localHeapOffset >> _threadShiftBits][globalBagNum & _numBagsPerSubHeapMask];
+		*bag = &getSubHeapBags(localHeapOffset >> _threadShiftBits)[getRowBagNum(globalBagNum, heapIndex)];
 	
 		// Check whether this is a valid address.
 		// It should be aligned to the specific sizeClass at least.
-		if((localBagOffset & (*bag)->classMask) != 0) {
-				PRERR("Invalid object: addr %p, classSize 0x%lx, classMask 0x%lx, offset 0x%lx",
-							addr, (*bag)->classSize, (*bag)->classMask, localBagOffset);
+		unsigned long objectIndex = getObjectIndex(localBagOffset, *bag);
+		if(objectIndex * (*bag)->classSize != localBagOffset) {
+				PRERR("Invalid object: addr %p, classSize 0x%lx, offset 0x%lx",
+							addr, (*bag)->classSize, localBagOffset);
       printCallStack();
       exit(EXIT_FAILURE);
 		}
@@ -735,7 +2111,7 @@ private:
 		// Check whether this object is already freed or not.
 		shadowObjectInfo * shadowinfo = (shadowObjectInfo *)(_shadowMemBegin + (heapIndex << _shadowMemSizePerHeapCeilShiftBits) + (*bag)->startShadowMemOffset);
 
-		return &shadowinfo[localBagOffset >> (*bag)->shiftBits];
+		return &shadowinfo[objectIndex];
 	}
 
 	inline shadowObjectInfo * getShadowObjectInfo(void * addr, PerThreadBag * bag, bool debug = false) {
@@ -747,7 +2123,7 @@ private:
 		shadowObjectInfo * bagShadowInfo = (shadowObjectInfo *)(_shadowMemBegin + (heapIndex << _shadowMemSizePerHeapCeilShiftBits) + bag->startShadowMemOffset);
 
 		#ifdef DEBUG
-		shadowObjectInfo * retval = &bagShadowInfo[localBagOffset >> bag->shiftBits];
+		shadowObjectInfo * retval = &bagShadowInfo[getObjectIndex(localBagOffset, bag)];
 		if(!debug) {
 				void * checkAddr = getAddrFromShadowInfo(retval, bag, true);
 				if(checkAddr != addr) {
@@ -765,7 +2141,7 @@ private:
 		}
 		return retval;
 		#else
-		return &bagShadowInfo[localBagOffset >> bag->shiftBits];
+		return &bagShadowInfo[getObjectIndex(localBagOffset, bag)];
 		#endif
 	}
 
@@ -781,8 +2157,8 @@ private:
 		heapOffset = heapIndex << _heapSizeShiftBits; 
 
 		#ifdef DEBUG
+		void * retval = (void *)(_heapBegin + heapOffset + bag->startOffset + (objectindex * bag->classSize));
 		if(!debug) {
-				void * retval = (void *)(_heapBegin + heapOffset + bag->startOffset + (objectindex << bag->shiftBits));
 				shadowObjectInfo * checkAddr = getShadowObjectInfo(retval, bag, true);
 				if(checkAddr != shadowaddr) {
 						PRERR("ERROR: getAddrFromShadowInfo: self-check failed");
@@ -794,18 +2170,10 @@ private:
 		}
 		return retval;
 		#else
-		return (void *)(_heapBegin + heapOffset + bag->startOffset + (objectindex << bag->shiftBits));
+		return (void *)(_heapBegin + heapOffset + bag->startOffset + (objectindex * bag->classSize));
 		#endif
 	}	
 
-	#ifdef CFREELIST
-  inline void realFreeCurrentList(PerThreadBag * bag, unsigned numBagSetItem) {
-		FREELIST_MERGE(&bag->cfreelist, &bag->freelist[numBagSetItem]);
-    bag->ncfree = 0;
-    initSLL(&bag->cfreelist);
-  }
-	#endif
-
 	#ifdef ENABLE_GUARDPAGE
   inline int setGuardPage(void * bagStartAddr, size_t guardsize, size_t guardoffset) {
     if(guardsize == 0) { return 0; }
@@ -825,7 +2193,7 @@ private:
 		return mresult;
 		*/
 
-    return mprotect((void *)guardaddr, guardsize, PROT_NONE); 
+    return MM::guardInstall((void *)guardaddr, guardsize);
   }
 	#endif
 
@@ -0,0 +1,245 @@
+/*
+ * FreeGuard: A Faster Secure Heap Allocator
+ * Copyright (C) 2017 Sam Silvestro, Hongyu Liu, Corey Crosser,
+ *                    Zhiqiang Lin, and Tongping Liu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * @file   bigcache.hh: keeps the mappings of freed large objects for reuse.
+ */
+#ifndef __BIGCACHE_HH__
+#define __BIGCACHE_HH__
+
+#include <pthread.h>
+#include <time.h>
+#include "mm.hh"
+#include "bigunmap.hh"
+#include "xdefines.hh"
+
+#ifdef BIG_MAPPING_CACHE
+// A cached mapping, whose first bytes hold this header.
+struct cachedMapping {
+	cachedMapping * next;
+	size_t mapSize;
+	unsigned guardMappings;
+	// When the mapping was cached, in milliseconds.
+	unsigned long cachedTime;
+};
+
+// Mappings cached by the current thread, which are not visible to others.
+struct threadMappingCache {
+	cachedMapping * buckets[BIG_CACHE_BUCKETS];
+	size_t bytes;
+	unsigned long lastTrimTime;
+};
+static __thread threadMappingCache _threadMappingCache __attribute__((tls_model("initial-exec")));
+
+// Large object mappings are sized in classes, BIG_CACHE_CLASS_STEPS per power
+// of two, so that a freed one fits later requests of similar size. Mappings
+// are released with MADV_FREE once cached, then kept by the freeing thread,
+// and beyond its share, in a cache shared by all threads. Mappings that have
+// been cached for longer than BIG_CACHE_MAX_AGE_MS are unmapped.
+class BigMappingCache {
+public:
+  static BigMappingCache &getInstance() {
+      static char buf[sizeof(BigMappingCache)];
+      static BigMappingCache* theOneTrueObject = new (buf) BigMappingCache();
+      return *theOneTrueObject;
+  }
+
+	void initialize() {
+		pthread_spin_init(&_lock, PTHREAD_PROCESS_PRIVATE);
+	}
+
+	// Returns the mapping size to use for the given one, and its bucket, or
+	// -1 if mappings of that size are not cached.
+	static int getClass(size_t * mapSize) {
+		size_t pages = *mapSize >> PageSizeShiftBits;
+		if(pages < BIG_CACHE_MIN_PAGES || *mapSize > BIG_CACHE_MAX_SIZE) {
+			return -1;
+		}
+		unsigned power = LOG2(pages);
+		size_t step = (1UL << power) / BIG_CACHE_CLASS_STEPS;
+		size_t classPages = alignup(pages, step);
+		*mapSize = classPages << PageSizeShiftBits;
+		return (power - LOG2(BIG_CACHE_MIN_PAGES)) * BIG_CACHE_CLASS_STEPS + (classPages >> LOG2(step)) - BIG_CACHE_CLASS_STEPS;
+	}
+
+	// Takes a cached mapping of the given class, or returns NULL.
+	void * take(int bucket, unsigned * guardMappings) {
+		threadMappingCache * cache = &_threadMappingCache;
+		cachedMapping * mapping = cache->buckets[bucket];
+		if(mapping != NULL) {
+			cache->buckets[bucket] = mapping->next;
+			cache->bytes -= mapping->mapSize;
+		} else if(__atomic_load_n(&_buckets[bucket], __ATOMIC_RELAXED) != NULL) {
+			pthread_spin_lock(&_lock);
+			mapping = _buckets[bucket];
+			if(mapping != NULL) {
+				_buckets[bucket] = mapping->next;
+				_bytes -= mapping->mapSize;
+			}
+			pthread_spin_unlock(&_lock);
+		}
+
+		trimIfDue(getTime());
+		if(mapping == NULL) {
+			return NULL;
+		}
+		*guardMappings = mapping->guardMappings;
+		return mapping;
+	}
+
+	// Caches the mapping of a freed object, or unmaps it if the caches are full.
+	// The guard page at its end, if any, stays in place.
+	void put(void * start, size_t mapSize, size_t guardSize, int bucket, unsigned guardMappings) {
+		if(madvise(start, mapSize - guardSize, MADV_FREE) != 0) {
+			madvise(start, mapSize - guardSize, MADV_DONTNEED);
+		}
+
+		unsigned long now = getTime();
+		cachedMapping * mapping = (cachedMapping *)start;
+		mapping->mapSize = mapSize;
+		mapping->guardMappings = guardMappings;
+		mapping->cachedTime = now;
+
+		threadMappingCache * cache = &_threadMappingCache;
+		if(cache->bytes + mapSize <= BIG_CACHE_THREAD_BYTES) {
+			mapping->next = cache->buckets[bucket];
+			cache->buckets[bucket] = mapping;
+			cache->bytes += mapSize;
+		} else {
+			putShared(mapping, bucket);
+		}
+
+		trimIfDue(now);
+	}
+
+	// Hands the mappings cached by the current thread over to the shared
+	// cache, after unmapping the expired ones. Called when the thread exits.
+	void flushThreadCache() {
+		threadMappingCache * cache = &_threadMappingCache;
+		unsigned long now = getTime();
+		trimThreadCache(now);
+		for(unsigned bucket = 0; bucket < BIG_CACHE_BUCKETS; bucket++) {
+			while(cache->buckets[bucket] != NULL) {
+				cachedMapping * mapping = cache->buckets[bucket];
+				cache->buckets[bucket] = mapping->next;
+				putShared(mapping, bucket);
+			}
+		}
+		cache->bytes = 0;
+		trimSharedCache(now);
+	}
+
+private:
+	cachedMapping * _buckets[BIG_CACHE_BUCKETS];
+	size_t _bytes;
+	pthread_spinlock_t _lock;
+
+	static unsigned long getTime() {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+	}
+
+	void putShared(cachedMapping * mapping, int bucket) {
+		bool cached = false;
+		pthread_spin_lock(&_lock);
+		if(_bytes + mapping->mapSize <= BIG_CACHE_BYTES) {
+			mapping->next = _buckets[bucket];
+			_buckets[bucket] = mapping;
+			_bytes += mapping->mapSize;
+			cached = true;
+		}
+		pthread_spin_unlock(&_lock);
+
+		if(!cached) {
+			release(mapping);
+		}
+	}
+
+	static void release(cachedMapping * mapping) {
+		#ifdef BATCHED_BIG_UNMAP
+		BigUnmapQueue::getInstance().add(mapping, mapping->mapSize, mapping->guardMappings);
+		#else
+		unsigned guardMappings = mapping->guardMappings;
+		MM::mmapDeallocate(mapping, mapping->mapSize);
+		MM::guardRemoved(guardMappings);
+		#endif
+	}
+
+	// Removes the mappings cached before the given time from the list and
+	// returns them. Mappings handed over by exiting threads are not in time
+	// order, so the whole list is scanned.
+	static cachedMapping * cutExpired(cachedMapping ** list, unsigned long cutoff, size_t * bytes) {
+		cachedMapping * expired = NULL;
+		cachedMapping ** link = list;
+		while(*link != NULL) {
+			cachedMapping * mapping = *link;
+			if(mapping->cachedTime < cutoff) {
+				*link = mapping->next;
+				mapping->next = expired;
+				expired = mapping;
+				*bytes -= mapping->mapSize;
+			} else {
+				link = &mapping->next;
+			}
+		}
+		return expired;
+	}
+
+	static void releaseAll(cachedMapping * mapping) {
+		while(mapping != NULL) {
+			cachedMapping * next = mapping->next;
+			release(mapping);
+			mapping = next;
+		}
+	}
+
+	// Unmaps expired mappings at most once per BIG_CACHE_TRIM_INTERVAL_MS,
+	// whether the thread is caching or reusing them.
+	void trimIfDue(unsigned long now) {
+		threadMappingCache * cache = &_threadMappingCache;
+		if(now - cache->lastTrimTime >= BIG_CACHE_TRIM_INTERVAL_MS) {
+			cache->lastTrimTime = now;
+			trimThreadCache(now);
+			trimSharedCache(now);
+		}
+	}
+
+	void trimThreadCache(unsigned long now) {
+		threadMappingCache * cache = &_threadMappingCache;
+		for(unsigned bucket = 0; bucket < BIG_CACHE_BUCKETS; bucket++) {
+			releaseAll(cutExpired(&cache->buckets[bucket], now - BIG_CACHE_MAX_AGE_MS, &cache->bytes));
+		}
+	}
+
+	void trimSharedCache(unsigned long now) {
+		cachedMapping * expired[BIG_CACHE_BUCKETS];
+		pthread_spin_lock(&_lock);
+		for(unsigned bucket = 0; bucket < BIG_CACHE_BUCKETS; bucket++) {
+			expired[bucket] = cutExpired(&_buckets[bucket], now - BIG_CACHE_MAX_AGE_MS, &_bytes);
+		}
+		pthread_spin_unlock(&_lock);
+
+		for(unsigned bucket = 0; bucket < BIG_CACHE_BUCKETS; bucket++) {
+			releaseAll(expired[bucket]);
+		}
+	}
+};
+#endif
+
+#endif // __BIGCACHE_HH__
@@ -27,17 +27,26 @@
 #include "real.hh"
 #include "xthread.hh"
 #include "mm.hh"
+#include "bigcache.hh"
+#include "bigunmap.hh"
 #include "xdefines.hh"
 #include "errmsg.hh"
 
 class BigHeap {
 
 private:
+	// Entries of the page map. An entry is in use while object is set, which
+	// is written last when adding an object and cleared first when removing it.
 	class bigObjectStatus {
 		public: 
+			void * object;
 			void * start;
 			size_t size; 
 			size_t pageUpSize; 
+			// The size of the mapping, including the guard behind the object.
+			size_t mapSize;
+			// Mappings added by that guard, see MM::guardRemoved().
+			unsigned guardMappings;
 
 			#ifdef DETECT_UAF
 			unsigned long long freedtime;
@@ -53,87 +62,275 @@ public:
 	
 	// Initialization of the Big Heap
 	void initBigHeap(void) {
-    // Initialize the spin_lock
-    pthread_spin_init(&_spin_lock, PTHREAD_PROCESS_PRIVATE);
-
-		// Initialize the hash map
-    _xmap.initialize(HashFuncs::hashAddr, HashFuncs::compareAddr, THREAD_MAP_SIZE);
+		// The page map starts out empty, its leaves are mapped as needed.
+		#ifdef BIG_MAPPING_CACHE
+		BigMappingCache::getInstance().initialize();
+		#endif
+		#ifdef BATCHED_BIG_UNMAP
+		BigUnmapQueue::getInstance().initialize();
+		#endif
 	} 
 
 	// For big objects, we don't have the quarantine list. 
 	// Actually, the size information will be kept until new allocation is 
-	void * allocateAtBigHeap(size_t size) {
+	// If zeroed is given, it is set to whether the object is known to hold
+	// only zeroes, as is the case for a fresh mapping.
+	void * allocateAtBigHeap(size_t size, bool * zeroed = NULL) {
 		assert(IF_CANARY_CONDITION);
+		return mapObject(size, zeroed);
+	}
+
+	// Allocates a chunk of whole pages for an arena, which may be smaller than
+	// the large objects allocateAtBigHeap() takes. The chunk is freed with
+	// deallocateToBigHeap() like any large object.
+	void * allocateChunkAtBigHeap(size_t size) {
+		assert((size & (PageSize - 1)) == 0);
+		return mapObject(size, NULL);
+	}
 
+	// Allocates an object aligned to the given power of two, of any size. As
+	// it has to start at such an address, it ends up to alignment (at most a
+	// page) minus one bytes short of its guard page. Mappings for alignments
+	// beyond a page are reserved with room to spare, which is unmapped again.
+	void * allocateAlignedAtBigHeap(size_t size, size_t alignment, bool * zeroed = NULL) {
 		size_t pageUpSize = alignup(size, PageSize);
-		size_t diff = pageUpSize - size;
-		bigObjectStatus * objStatus = (bigObjectStatus *)HeapAllocator::allocate(sizeof(bigObjectStatus));
-		void * ptr = MM::mmapAllocatePrivate(pageUpSize, NULL);
-		void * objStartPtr = (void *)((char *)ptr + diff);
-		acquireGlobalLock();
-    _xmap.insert(objStartPtr, sizeof(void *), objStatus);
-		releaseGlobalLock();
-
-		objStatus->start = ptr;
-		objStatus->pageUpSize = pageUpSize;
-		objStatus->size = size;
+		size_t mapSize = pageUpSize + BIG_GUARD_SIZE;
+		char * ptr;
+		if(alignment <= PageSize) {
+			ptr = (char *)MM::mmapAllocatePrivate(mapSize, NULL);
+		} else {
+			size_t reservedSize = mapSize + alignment - PageSize;
+			char * reserved = (char *)MM::mmapAllocatePrivate(reservedSize, NULL);
+			ptr = (char *)alignupPointer(reserved, alignment);
+			if(ptr > reserved) {
+				MM::mmapDeallocate(reserved, ptr - reserved);
+			}
+			if(reserved + reservedSize > ptr + mapSize) {
+				MM::mmapDeallocate(ptr + mapSize, reserved + reservedSize - (ptr + mapSize));
+			}
+		}
+		unsigned guardMappings = installGuard(ptr + pageUpSize);
+		if(zeroed != NULL) {
+			*zeroed = true;
+		}
 
-		//PRDBG("BigHeap returning %p (begins @ %p), size %zu (actual %zu)", objStartPtr, ptr, size, pageUpSize);
-		return objStartPtr;
+		void * objStartPtr = (void *)aligndown((uintptr_t)(ptr + pageUpSize - size), alignment);
+		return addObject(objStartPtr, ptr, size, mapSize, guardMappings);
 	}
 
+	// Returns the bytes usable from addr on, up to the object's guard page.
   size_t getObjectSize(void * addr) {
-    bigObjectStatus * objStatus;
-		if(!_xmap.find(addr, sizeof(void *), &objStatus)) {
+    bigObjectStatus * objStatus = findObject(addr);
+		if(objStatus == NULL) {
 			return -1;
 		}
-    return objStatus->size;
+    return (char *)objStatus->start + objStatus->mapSize - BIG_GUARD_SIZE - (char *)addr;
   }
 
+	// Returns the usable size of an object allocated for the given request.
+	static size_t getAllocationSize(size_t size, size_t alignment) {
+		size_t pageUpSize = alignup(size, PageSize);
+		return pageUpSize - aligndown(pageUpSize - size, alignment);
+	}
+
   bool isLargeObject(void * addr) {
-		bigObjectStatus * objStatus;
-		return(_xmap.find(addr, sizeof(void *), &objStatus));
+		return(findObject(addr) != NULL);
   }
 
-	void deallocateToBigHeap(void * ptr) {
-    bigObjectStatus * objStatus;
-		if(!_xmap.find(ptr, sizeof(void *), &objStatus)) {
+	// If the caller knows the object's size, it is checked to not exceed the
+	// actual one.
+	void deallocateToBigHeap(void * ptr, size_t size = 0) {
+    bigObjectStatus * objStatus = getStatus(ptr, false);
+		bigObjectStatus removed;
+		if(objStatus != NULL) {
+			removed = *objStatus;
+			if(removed.object == ptr && size > removed.size) {
+				PRINT("size %zu given for object %p exceeds its size %zu", size, ptr, removed.size);
+				printCallStack();
+				exit(-1);
+			}
+		}
+		// Of several threads freeing the object, only one can clear the entry.
+		void * expected = ptr;
+		if(objStatus == NULL || !__atomic_compare_exchange_n(&objStatus->object, &expected, NULL,
+					false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
 			PRINT("invalid or double free on address %p", ptr);
       printCallStack();
       exit(-1);
 		}
 
-		//PRDBG("BigHeap freed %p (begins @ %p), size %zu (actual %zu), objStatus @ %p",
-		//				ptr, objStatus->start, objStatus->size, objStatus->pageUpSize, objStatus);
-		acquireGlobalLock();
-		_xmap.erase(ptr, sizeof(void *));
-		releaseGlobalLock();
-		MM::mmapDeallocate(objStatus->start, objStatus->pageUpSize);
-		HeapAllocator::deallocate(objStatus);
+		//PRDBG("BigHeap freed %p (begins @ %p), size %zu (actual %zu)",
+		//				ptr, removed.start, removed.size, removed.pageUpSize);
+		#ifdef BIG_MAPPING_CACHE
+		size_t mapSize = removed.mapSize;
+		int bucket = BigMappingCache::getClass(&mapSize);
+		if(bucket >= 0 && mapSize == removed.mapSize) {
+			BigMappingCache::getInstance().put(removed.start, removed.mapSize, BIG_GUARD_SIZE, bucket, removed.guardMappings);
+			return;
+		}
+		#endif
+		releaseMapping(removed.start, removed.mapSize, removed.guardMappings);
+	}
+
+	// Resizes the object without copying it: shrinking unmaps the pages it no
+	// longer needs, while growing moves its pages with mremap() into a mapping
+	// large enough. As the object's offset within its first page stays the
+	// same, a resized object may end up to a page short of its guard. Returns
+	// NULL if the object could not be resized this way.
+	void * reallocateAtBigHeap(void * ptr, size_t newSize) {
+		// The entry is claimed just like when freeing the object.
+		bigObjectStatus * objStatus = getStatus(ptr, false);
+		void * expected = ptr;
+		if(objStatus == NULL || !__atomic_compare_exchange_n(&objStatus->object, &expected, NULL,
+					false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return NULL;
+		}
+
+		char * pages = (char *)aligndown((uintptr_t)ptr, PageSize);
+		size_t offset = (char *)ptr - pages;
+		size_t oldLength = alignup(offset + objStatus->size, PageSize);
+		size_t newLength = alignup(offset + newSize, PageSize);
+		char * mapStart = (char *)objStatus->start;
+		char * mapEnd = mapStart + objStatus->mapSize;
+
+		if(newLength > oldLength) {
+			char * newPages = (char *)MM::mmapRemap(pages, oldLength, newLength + BIG_GUARD_SIZE);
+			if(newPages == NULL) {
+				__atomic_store_n(&objStatus->object, ptr, __ATOMIC_RELEASE);
+				return NULL;
+			}
+			unsigned guardMappings = installGuard(newPages + newLength);
+
+			// Left behind are the pages in front of the object and its old guard.
+			if(pages > mapStart) {
+				releaseMapping(mapStart, pages - mapStart, 0);
+			}
+			if(mapEnd > pages + oldLength && newPages != pages) {
+				releaseMapping(pages + oldLength, mapEnd - (pages + oldLength), objStatus->guardMappings);
+			}
+
+			void * newPtr = newPages + offset;
+			objStatus = getStatus(newPtr, true);
+			objStatus->start = newPages;
+			objStatus->mapSize = newLength + BIG_GUARD_SIZE;
+			objStatus->guardMappings = guardMappings;
+			ptr = newPtr;
+		} else if(newLength + BIG_GUARD_SIZE < oldLength) {
+			unsigned guardMappings = installGuard(pages + newLength);
+			releaseMapping(pages + newLength + BIG_GUARD_SIZE, mapEnd - (pages + newLength + BIG_GUARD_SIZE),
+					objStatus->guardMappings);
+			objStatus->mapSize = pages + newLength + BIG_GUARD_SIZE - mapStart;
+			objStatus->guardMappings = guardMappings;
+		}
+
+		objStatus->size = newSize;
+		objStatus->pageUpSize = alignup(newSize, PageSize);
+		__atomic_store_n(&objStatus->object, ptr, __ATOMIC_RELEASE);
+		return ptr;
 	}
 
-  void acquireGlobalLock() {
-    spin_lock();
-  } 
-  
-  void releaseGlobalLock() {
-    spin_unlock();
-  }
-  
 private:
-	size_t _bigObjectStatusSize = sizeof(bigObjectStatus);
-	unsigned _bigObjectStatusSizeShiftBits = LOG2(_bigObjectStatusSize);
-	pthread_spinlock_t _spin_lock;
-	typedef HashMap<void *, bigObjectStatus *, HeapAllocator> objectHashMap;
-  objectHashMap _xmap;
-
-  inline void spin_lock() {
-    pthread_spin_lock(&_spin_lock);
-  }
-    
-  inline void spin_unlock() {
-    pthread_spin_unlock(&_spin_lock);
-  }
+	// Allocates an object of any size, up against a guard page.
+	void * mapObject(size_t size, bool * zeroed) {
+		size_t pageUpSize = alignup(size, PageSize);
+		unsigned guardMappings = 0;
+		// The object ends right at a guard page.
+		size_t mapSize = pageUpSize + BIG_GUARD_SIZE;
+		void * ptr = NULL;
+		bool fresh = false;
+		#ifdef BIG_MAPPING_CACHE
+		// A cached mapping of the same class comes with its guard in place.
+		int bucket = BigMappingCache::getClass(&mapSize);
+		if(bucket >= 0) {
+			ptr = BigMappingCache::getInstance().take(bucket, &guardMappings);
+		}
+		if(ptr == NULL)
+		#endif
+		{
+			ptr = MM::mmapAllocatePrivate(mapSize, NULL);
+			guardMappings = installGuard((char *)ptr + mapSize - BIG_GUARD_SIZE);
+			fresh = true;
+		}
+		if(zeroed != NULL) {
+			*zeroed = fresh;
+		}
+		void * objStartPtr = (void *)((char *)ptr + mapSize - BIG_GUARD_SIZE - size);
+
+		//PRDBG("BigHeap returning %p (begins @ %p), size %zu (actual %zu)", objStartPtr, ptr, size, pageUpSize);
+		return addObject(objStartPtr, ptr, size, mapSize, guardMappings);
+	}
+
+	// Enters the object into the page map, which makes it visible to others.
+	inline void * addObject(void * object, void * start, size_t size, size_t mapSize, unsigned guardMappings) {
+		bigObjectStatus * objStatus = getStatus(object, true);
+		objStatus->start = start;
+		objStatus->pageUpSize = alignup(size, PageSize);
+		objStatus->mapSize = mapSize;
+		objStatus->guardMappings = guardMappings;
+		objStatus->size = size;
+		__atomic_store_n(&objStatus->object, object, __ATOMIC_RELEASE);
+		return object;
+	}
+
+	// Puts a guard page at the given address, returning the mappings it takes.
+	static unsigned installGuard(char * guard) {
+		#ifdef ENABLE_GUARDPAGE
+		if(MM::guardInstall(guard, PageSize, 1) == 0 && MM::guardsTakeMappings()) {
+			return 1;
+		}
+		#endif
+		return 0;
+	}
+
+	// Unmaps memory of large objects, along with the guard mappings it takes.
+	static void releaseMapping(void * start, size_t size, unsigned guardMappings) {
+		#ifdef BATCHED_BIG_UNMAP
+		BigUnmapQueue::getInstance().add(start, size, guardMappings);
+		#else
+		MM::mmapDeallocate(start, size);
+		MM::guardRemoved(guardMappings);
+		#endif
+	}
+
+	// The page map has one entry for every page an object may start in,
+	// kept in leaves that are mapped on first use and never released.
+	bigObjectStatus * _pageMap[BIG_PAGE_MAP_ROOT_ENTRIES];
+
+	// Returns the page map entry of the object starting at addr if there is
+	// one, without taking any locks.
+	inline bigObjectStatus * findObject(void * addr) {
+		bigObjectStatus * objStatus = getStatus(addr, false);
+		if(objStatus == NULL || __atomic_load_n(&objStatus->object, __ATOMIC_ACQUIRE) != addr) {
+			return NULL;
+		}
+		return objStatus;
+	}
+
+	// Returns the page map entry for the page addr lies in, mapping its leaf
+	// if there is none yet and create is set.
+	inline bigObjectStatus * getStatus(void * addr, bool create) {
+		uintptr_t page = (uintptr_t)addr >> PageSizeShiftBits;
+		uintptr_t rootIndex = page >> BIG_PAGE_MAP_LEAF_BITS;
+		if(rootIndex >= BIG_PAGE_MAP_ROOT_ENTRIES) {
+			return NULL;
+		}
+
+		bigObjectStatus * leaf = __atomic_load_n(&_pageMap[rootIndex], __ATOMIC_ACQUIRE);
+		if(leaf == NULL) {
+			if(!create) {
+				return NULL;
+			}
+			leaf = (bigObjectStatus *)MM::mmapAllocatePrivate(BIG_PAGE_MAP_LEAF_ENTRIES * sizeof(bigObjectStatus));
+			bigObjectStatus * current = NULL;
+			if(!__atomic_compare_exchange_n(&_pageMap[rootIndex], &current, leaf,
+						false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				// Another thread installed this leaf first.
+				MM::mmapDeallocate(leaf, BIG_PAGE_MAP_LEAF_ENTRIES * sizeof(bigObjectStatus));
+				leaf = current;
+			}
+		}
+		return &leaf[page & (BIG_PAGE_MAP_LEAF_ENTRIES - 1)];
+	}
 };	
 
-#endif // __BIGHEAP_HH__	
+#endif // __BIGHEAP_HH__
@@ -0,0 +1,194 @@
+/*
+ * FreeGuard: A Faster Secure Heap Allocator
+ * Copyright (C) 2017 Sam Silvestro, Hongyu Liu, Corey Crosser,
+ *                    Zhiqiang Lin, and Tongping Liu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * @file   bigunmap.hh: unmaps the mappings of freed large objects in batches.
+ */
+#ifndef __BIGUNMAP_HH__
+#define __BIGUNMAP_HH__
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "mm.hh"
+#include "real.hh"
+#include "log.hh"
+#include "xdefines.hh"
+
+#ifdef BATCHED_BIG_UNMAP
+// Freed mappings are queued instead of unmapped right away, and retired by a
+// background thread in batches, with adjacent mappings unmapped together.
+// Without the thread (or when it falls behind), the thread whose free fills
+// the queue or brings it past BIG_UNMAP_MAX_BYTES retires the batch itself.
+class BigUnmapQueue {
+	struct pendingUnmap {
+		char * start;
+		size_t size;
+		unsigned guardMappings;
+	};
+
+	// States of the background thread, which it waits on.
+	enum { UNMAP_HELPER_BUSY, UNMAP_HELPER_DELAYING, UNMAP_HELPER_IDLE };
+
+public:
+  static BigUnmapQueue &getInstance() {
+      static char buf[sizeof(BigUnmapQueue)];
+      static BigUnmapQueue* theOneTrueObject = new (buf) BigUnmapQueue();
+      return *theOneTrueObject;
+  }
+
+	void initialize() {
+		pthread_spin_init(&_lock, PTHREAD_PROCESS_PRIVATE);
+	}
+
+	// Starts the background thread. It never allocates, and runs with all
+	// signals blocked.
+	void startHelper() {
+		sigset_t allSignals, oldSignals;
+		sigfillset(&allSignals);
+		pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+		pthread_t helper;
+		int result = Real::pthread_create(&helper, NULL, unmapHelperThread, NULL);
+		pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+		if(result != 0) {
+			PRERR("Failed to start the unmap thread: %s", strerror(result));
+			return;
+		}
+		_helperRunning = true;
+		pthread_atfork(NULL, NULL, unmapHelperAfterFork);
+	}
+
+	// Queues the mapping for unmapping, and the guard mappings it takes.
+	void add(void * start, size_t size, unsigned guardMappings) {
+		pendingUnmap batch[BIG_UNMAP_QUEUE_SIZE];
+		unsigned batchCount = 0;
+
+		pthread_spin_lock(&_lock);
+		pendingUnmap * entry = &_pending[_count++];
+		entry->start = (char *)start;
+		entry->size = size;
+		entry->guardMappings = guardMappings;
+		_bytes += size;
+		bool retireHere = (_count == BIG_UNMAP_QUEUE_SIZE || _bytes >= BIG_UNMAP_MAX_BYTES ||
+				(!_helperRunning && _bytes >= BIG_UNMAP_BATCH_BYTES));
+		if(retireHere) {
+			batchCount = takeBatch(batch);
+		}
+		size_t bytes = _bytes;
+		pthread_spin_unlock(&_lock);
+
+		if(retireHere) {
+			retire(batch, batchCount);
+			return;
+		}
+
+		// The helper is only woken when it has nothing pending, or when a batch
+		// is complete; otherwise it picks up the queue once its delay is over.
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		int state = __atomic_load_n(&_helperState, __ATOMIC_SEQ_CST);
+		if(state == UNMAP_HELPER_IDLE || (state == UNMAP_HELPER_DELAYING && bytes >= BIG_UNMAP_BATCH_BYTES)) {
+			__atomic_store_n(&_helperState, UNMAP_HELPER_BUSY, __ATOMIC_SEQ_CST);
+			syscall(SYS_futex, &_helperState, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+		}
+	}
+
+private:
+	pendingUnmap _pending[BIG_UNMAP_QUEUE_SIZE];
+	unsigned _count;
+	size_t _bytes;
+	pthread_spinlock_t _lock;
+	int _helperState;
+	bool _helperRunning;
+
+	// Moves the queued mappings into batch; called with the lock held.
+	unsigned takeBatch(pendingUnmap * batch) {
+		unsigned count = _count;
+		memcpy(batch, _pending, count * sizeof(pendingUnmap));
+		_count = 0;
+		_bytes = 0;
+		return count;
+	}
+
+	// Unmaps the batch in address order, one call per run of adjacent mappings.
+	static void retire(pendingUnmap * batch, unsigned count) {
+		for(unsigned i = 1; i < count; i++) {
+			pendingUnmap entry = batch[i];
+			unsigned j = i;
+			for(; j > 0 && batch[j - 1].start > entry.start; j--) {
+				batch[j] = batch[j - 1];
+			}
+			batch[j] = entry;
+		}
+
+		unsigned i = 0;
+		while(i < count) {
+			char * start = batch[i].start;
+			char * end = start + batch[i].size;
+			unsigned guardMappings = batch[i].guardMappings;
+			for(i++; i < count && batch[i].start == end; i++) {
+				end += batch[i].size;
+				guardMappings += batch[i].guardMappings;
+			}
+			MM::mmapDeallocate(start, end - start);
+			MM::guardRemoved(guardMappings);
+		}
+	}
+
+	static void * unmapHelperThread(void *) {
+		getInstance().runHelper();
+		return NULL;
+	}
+
+	// Retires whatever is queued, BIG_UNMAP_DELAY_MS after the first mapping
+	// has been queued or as soon as a batch is complete.
+	void runHelper() {
+		struct timespec delay = { 0, BIG_UNMAP_DELAY_MS * 1000000L };
+		pendingUnmap batch[BIG_UNMAP_QUEUE_SIZE];
+		while(true) {
+			__atomic_store_n(&_helperState, UNMAP_HELPER_IDLE, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&_count, __ATOMIC_SEQ_CST) == 0) {
+				syscall(SYS_futex, &_helperState, FUTEX_WAIT_PRIVATE, UNMAP_HELPER_IDLE, NULL, NULL, 0);
+			}
+
+			__atomic_store_n(&_helperState, UNMAP_HELPER_DELAYING, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&_bytes, __ATOMIC_SEQ_CST) < BIG_UNMAP_BATCH_BYTES) {
+				syscall(SYS_futex, &_helperState, FUTEX_WAIT_PRIVATE, UNMAP_HELPER_DELAYING, &delay, NULL, 0);
+			}
+			__atomic_store_n(&_helperState, UNMAP_HELPER_BUSY, __ATOMIC_SEQ_CST);
+
+			pthread_spin_lock(&_lock);
+			unsigned count = takeBatch(batch);
+			pthread_spin_unlock(&_lock);
+			retire(batch, count);
+		}
+	}
+
+	// The thread does not survive fork(); the child retires batches itself.
+	static void unmapHelperAfterFork() {
+		BigUnmapQueue & queue = getInstance();
+		queue._helperRunning = false;
+		queue._helperState = UNMAP_HELPER_BUSY;
+		pthread_spin_init(&queue._lock, PTHREAD_PROCESS_PRIVATE);
+	}
+};
+#endif
+
+#endif // __BIGUNMAP_HH__
@@ -0,0 +1,179 @@
+/*
+ * FreeGuard: A Faster Secure Heap Allocator
+ * Copyright (C) 2017 Sam Silvestro, Hongyu Liu, Corey Crosser,
+ *                    Zhiqiang Lin, and Tongping Liu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * @file   freeguard.h: FreeGuard's own allocation interface, for programs
+ *         linked against libfreeguard.
+ */
+#ifndef __FREEGUARD_H__
+#define __FREEGUARD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns the usable size malloc() or, with the log2 of an alignment in the
+// low six bits of flags, aligned_alloc() would give for size bytes.
+size_t freeguard_nallocx(size_t size, int flags);
+
+// Returns the size class serving objects of the given size and alignment, or
+// -1 if they are large. Objects of a class are allocated and freed without
+// looking their class up again, nor checking that the heap is initialized.
+int freeguard_size_class(size_t size, size_t alignment);
+// Allocates size bytes from a class that fits them, and returns NULL with errno
+// set to ENOMEM once the class has run out.
+void * freeguard_malloc_class(int sizeClass, size_t size);
+// Frees an object allocated with freeguard_malloc_class(sizeClass).
+void freeguard_free_class(void * ptr, int sizeClass);
+
+// Allocates n objects of the given size into objects[], returning how many
+// were allocated, and frees n objects at once.
+size_t freeguard_malloc_batch(size_t size, size_t n, void ** objects);
+void freeguard_free_batch(void ** objects, size_t n);
+
+// Arenas hand out objects that are all released at once: reset() releases
+// all of an arena's objects, and destroy() the arena along with them. An
+// arena takes memory in chunks of chunkSize bytes (256KB if 0), each followed
+// by a guard page. Arenas must not be used by several threads at once.
+typedef struct freeguard_arena freeguard_arena;
+freeguard_arena * freeguard_arena_create(size_t chunkSize);
+void * freeguard_arena_alloc(freeguard_arena * arena, size_t size);
+void freeguard_arena_reset(freeguard_arena * arena);
+void freeguard_arena_destroy(freeguard_arena * arena);
+
+// Tags keep the small objects of different subsystems in bags of their own,
+// and count the objects of each. Tags range from 1 to 7 in builds with
+// TAGGED_HEAPS; tag 0 is the same as malloc(). freeguard_get_tag_stats() returns
+// EINVAL for tags out of range.
+typedef struct {
+	size_t live_bytes;
+	size_t live_objects;
+} freeguard_tag_stats;
+void * freeguard_malloc_tagged(unsigned tag, size_t size);
+int freeguard_get_tag_stats(unsigned tag, freeguard_tag_stats * stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(__cplusplus) && __cplusplus >= 201703L
+#include <memory_resource>
+#include <new>
+
+namespace freeguard {
+
+// A memory resource taking small objects straight from their size class.
+class memory_resource : public std::pmr::memory_resource {
+protected:
+	void * do_allocate(size_t bytes, size_t alignment) override {
+		int sizeClass = freeguard_size_class(bytes, alignment);
+		if(sizeClass < 0) {
+			return ::operator new(bytes, std::align_val_t(alignment));
+		}
+		void * ptr = freeguard_malloc_class(sizeClass, bytes);
+		if(ptr == nullptr) {
+			throw std::bad_alloc();
+		}
+		return ptr;
+	}
+
+	// Sized delete finds the class of objects with no more than the default
+	// alignment by itself.
+	void do_deallocate(void * ptr, size_t bytes, size_t alignment) override {
+		if(alignment <= alignof(max_align_t)) {
+			::operator delete(ptr, bytes);
+			return;
+		}
+		int sizeClass = freeguard_size_class(bytes, alignment);
+		if(sizeClass < 0) {
+			::operator delete(ptr, bytes, std::align_val_t(alignment));
+		} else {
+			freeguard_free_class(ptr, sizeClass);
+		}
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+		return dynamic_cast<const memory_resource *>(&other) != nullptr;
+	}
+};
+
+// Returns the resource shared by all users.
+inline memory_resource * get_memory_resource() {
+	static memory_resource resource;
+	return &resource;
+}
+
+// An allocator for node-based containers: single objects come from the size
+// class of T, which is looked up once, and anything else from operator new.
+template <class T>
+class allocator {
+public:
+	typedef T value_type;
+
+	allocator() noexcept { }
+	template <class U>
+	allocator(const allocator<U> &) noexcept { }
+
+	T * allocate(size_t n) {
+		int sizeClass = getSizeClass();
+		if(n == 1 && sizeClass >= 0) {
+			void * ptr = freeguard_malloc_class(sizeClass, sizeof(T));
+			if(ptr == nullptr) {
+				throw std::bad_alloc();
+			}
+			return static_cast<T *>(ptr);
+		}
+		if(n > SIZE_MAX / sizeof(T)) {
+			throw std::bad_array_new_length();
+		}
+		return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+	}
+
+	void deallocate(T * ptr, size_t n) noexcept {
+		int sizeClass = getSizeClass();
+		if(n == 1 && sizeClass >= 0) {
+			freeguard_free_class(ptr, sizeClass);
+		} else {
+			::operator delete(ptr, n * sizeof(T), std::align_val_t(alignof(T)));
+		}
+	}
+
+private:
+	static int getSizeClass() {
+		static const int sizeClass = freeguard_size_class(sizeof(T), alignof(T));
+		return sizeClass;
+	}
+};
+
+template <class T, class U>
+inline bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+	return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+	return false;
+}
+
+} // namespace freeguard
+#endif
+
+#endif // __FREEGUARD_H__
@@ -22,15 +22,16 @@
  * @author Sam Silvestro <sam.silvestro@utsa.edu>
  */
 #include <dlfcn.h>
+#include <errno.h>
+#include <new>
 #include <sys/mman.h>
 #include "real.hh"
 #include "xthread.hh"
 #include "bibopheap.hh"
 #include "mm.hh"
 #include "bigheap.hh"
-#ifdef SSE2RNG
-#include "sse2rng.h"
-#endif
+#include "arena.hh"
+#include "freeguard.h"
 
 void heapinitialize();
 __attribute__((constructor)) void initializer() {
@@ -52,16 +53,8 @@ extern "C" int freeguard_libc_start_main(main_fn_t main_fn, int argc, char** arg
 	}
 	madvise((void *)globalStackAddr, stackSize, MADV_NOHUGEPAGE);
 
-	// set guard pages in cusotmized stack area. Set in both the beginnning and end.
-	// better way is to set this when we use a new thread index, which may require changing the bool flag in thread_t to a int.
-	for(intptr_t i = 1; i < MAX_THREADS; i++) { // ingore the first thread
-		intptr_t stackStart = globalStackAddr + i * STACK_SIZE;
-		if(0 != mprotect((void*)(stackStart + STACK_SIZE - GUARD_PAGE_SIZE), GUARD_PAGE_SIZE, PROT_NONE)
-				|| 0 != mprotect((void*)stackStart, GUARD_PAGE_SIZE, PROT_NONE)) {
-			fprintf(stderr, "Failed to set guard pages\n");
-			abort();
-		}
-	}
+	// Guard pages are set at both ends of each thread's stack once its thread
+	// index is first used; see xthread::threadInitBeforeCreation().
 #ifdef CUSTOMIZED_MAIN_STACK
 	intptr_t ebp, esp, customizedEbp, customizedEsp, ebpOffset, espOffset;
 	intptr_t stackTop = (((intptr_t)&main_fn + PageSize) & ~(PageSize - 1)) + PageSize; // page align
@@ -143,6 +136,16 @@ extern "C" {
   void * xxpvalloc(size_t);
   void * xxalloca(size_t);
   int 	 xxposix_memalign(void **, size_t, size_t);
+	size_t xxmalloc_usable_size(void *);
+	void	 xxfree_sized(void *, size_t);
+	void	 xxfree_aligned_sized(void *, size_t, size_t);
+
+	typedef struct {
+		void * p;
+		size_t n;
+	} __sized_ptr_t;
+	__sized_ptr_t __size_returning_new(size_t);
+	__sized_ptr_t __size_returning_new_aligned(size_t, std::align_val_t);
 
 	// Function aliases
 	void free(void *) __attribute__ ((weak, alias("xxfree")));
@@ -158,16 +161,37 @@ extern "C" {
   void * alloca(size_t) __attribute__ ((weak, alias("xxalloca")));
   int posix_memalign(void **, size_t, size_t) __attribute__ ((weak,
         alias("xxposix_memalign")));
+	size_t malloc_usable_size(void *) __attribute__ ((weak, alias("xxmalloc_usable_size")));
+	void free_sized(void *, size_t) __attribute__ ((weak, alias("xxfree_sized")));
+	void free_aligned_sized(void *, size_t, size_t) __attribute__ ((weak,
+        alias("xxfree_aligned_sized")));
 }
 
 __attribute__((destructor)) void finalizer() {
 	PRDBG("%lu large objects (>%d) were allocated", numLargeObjects, LARGE_OBJECT_THRESHOLD);
+	if(MM::getGuardsSkipped() > 0) {
+		PRINT("%lu guards were skipped to stay within vm.max_map_count", MM::getGuardsSkipped());
+	}
+}
+
+void heapThreadExit() {
+	#ifdef THREAD_MAGAZINE
+	BibopHeap::getInstance().flushMagazines();
+	#endif
+	#ifdef CFREELIST
+	BibopHeap::getInstance().flushRemoteFrees();
+	#endif
+	#ifdef RELEASE_FREE_PAGES
+	BibopHeap::getInstance().flushPageReleases();
+	#endif
+	#ifdef BIG_MAPPING_CACHE
+	BigMappingCache::getInstance().flushThreadCache();
+	#endif
 }
 
 void heapinitialize() {
 	if(heapInitStatus == E_HEAP_INIT_NOT) {
 		heapInitStatus = E_HEAP_INIT_WORKING;
-    SRAND(time(NULL));
 		BibopHeap::getInstance().initialize();
 		heapInitStatus = E_HEAP_INIT_DONE;
 		// The following function will invoke dlopen and will call malloc in the end.
@@ -175,27 +199,44 @@ void heapinitialize() {
 		Real::initializer();
 		xthread::getInstance().initialize();
 		BigHeap::getInstance().initBigHeap();
+		rngInitialize();
+		#ifdef GUARD_HELPER_THREAD
+		BibopHeap::getInstance().startGuardHelper();
+		#endif
+		#ifdef BATCHED_BIG_UNMAP
+		BigUnmapQueue::getInstance().startHelper();
+		#endif
 	} else {
 			while(heapInitStatus != E_HEAP_INIT_DONE);
 	}
 }
 
- void * xxmalloc(size_t size) {
+ // If zeroed is given, it is set to whether the object is known to hold only zeroes.
+ static inline void * allocateObject(size_t size, bool * zeroed) {
     if(heapInitStatus != E_HEAP_INIT_DONE) {
 			heapinitialize();
     }
 
 		// Calculate the proper bag size needed to fulfill this request
 		if(IF_CANARY_CONDITION) {
+			// Sizes beyond the address space would wrap once rounded to pages.
+			if(size > SIZE_MAX - 2 * PageSize) {
+				errno = ENOMEM;
+				return NULL;
+			}
 			numLargeObjects++;
-			return BigHeap::getInstance().allocateAtBigHeap(size);
+			return BigHeap::getInstance().allocateAtBigHeap(size, zeroed);
 		} else {
-			return BibopHeap::getInstance().allocateSmallObject(size);
+			return BibopHeap::getInstance().allocateSmallObject(size, zeroed);
 		}
 
 		return NULL;
 }
 
+ void * xxmalloc(size_t size) {
+		return allocateObject(size, NULL);
+}
+
  void xxfree(void * ptr) {
 		if(ptr == NULL || heapInitStatus != E_HEAP_INIT_DONE) {
 			return;
@@ -210,11 +251,82 @@ void heapinitialize() {
     }
 }
 
+size_t xxmalloc_usable_size(void * ptr) {
+		if(ptr == NULL || heapInitStatus != E_HEAP_INIT_DONE) {
+			return 0;
+		}
+
+    if(BibopHeap::getInstance().isSmallObject(ptr)) {
+        return BibopHeap::getInstance().getObjectSize(ptr);
+    } else if(BigHeap::getInstance().isLargeObject(ptr)) {
+        return BigHeap::getInstance().getObjectSize(ptr);
+    }
+		PRERR("malloc_usable_size called with unknown object %p", ptr);
+		return 0;
+}
+
+// Frees an object of the given size and alignment, which are checked against
+// the object. Large sizes go to the big heap right away.
+static void freeSized(void * ptr, size_t size, size_t alignment) {
+		if(ptr == NULL || heapInitStatus != E_HEAP_INIT_DONE) {
+			return;
+		}
+
+		if(IF_CANARY_CONDITION) {
+				BigHeap::getInstance().deallocateToBigHeap(ptr, size);
+		} else if(BibopHeap::getInstance().isSmallObject(ptr)) {
+				BibopHeap::getInstance().freeSizedSmallObject(ptr, size, alignment);
+		} else {
+				// Aligned or shrunk objects may be large despite their size.
+				xxfree(ptr);
+		}
+}
+
+void xxfree_sized(void * ptr, size_t size) {
+		freeSized(ptr, size, 1);
+}
+
+void xxfree_aligned_sized(void * ptr, size_t alignment, size_t size) {
+		if(ptr != NULL && ((uintptr_t)ptr & (alignment - 1)) != 0) {
+				PRERR("free_aligned_sized: object %p is not aligned to %zu", ptr, alignment);
+				printCallStack();
+				exit(EXIT_FAILURE);
+		}
+		freeSized(ptr, size, alignment);
+}
+
+// Returns the usable size malloc() or, with the alignment given in flags,
+// aligned_alloc() would give for size bytes, or 0 if they would fail.
+size_t freeguard_nallocx(size_t size, int flags) {
+    if(heapInitStatus != E_HEAP_INIT_DONE) {
+			heapinitialize();
+    }
+
+		size_t alignment = 1UL << (flags & NALLOCX_LG_ALIGN_MASK);
+		if(size > SIZE_MAX - alignment - PageSize) {
+				return 0;
+		}
+		if(!IF_CANARY_CONDITION) {
+				size_t usableSize = BibopHeap::getInstance().getAllocationSize(size, alignment);
+				if(usableSize != 0) {
+						return usableSize;
+				}
+		}
+		return BigHeap::getAllocationSize(size, alignment);
+}
+
 void * xxcalloc(size_t nelem, size_t elsize) {
-	void * ptr = NULL;
-	ptr = malloc(nelem * elsize);
-	if(ptr != NULL) {
-		memset(ptr, 0, nelem * elsize);
+	size_t size;
+	if(__builtin_mul_overflow(nelem, elsize, &size)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Fresh memory from the kernel needs no zeroing.
+	bool zeroed = false;
+	void * ptr = allocateObject(size, &zeroed);
+	if(ptr != NULL && !zeroed) {
+		memset(ptr, 0, size);
 	}
 	return ptr;
 }
@@ -242,10 +354,12 @@ void * xxrealloc(void * ptr, size_t sz) {
 
 		// If the object is unknown to us, return NULL to indicate error.
 		size_t oldSize = -1;
+		bool isLarge = false;
     if(BibopHeap::getInstance().isSmallObject(ptr)) {
         oldSize = BibopHeap::getInstance().getObjectSize(ptr);
     } else if(BigHeap::getInstance().isLargeObject(ptr)) {
         oldSize = BigHeap::getInstance().getObjectSize(ptr);
+        isLarge = true;
     }
 
 		if(oldSize == -1) {
@@ -253,12 +367,27 @@ void * xxrealloc(void * ptr, size_t sz) {
 				return NULL;
 		}
 
-		if(oldSize >= sz) {
+		// Large objects that stay large are resized without copying them.
+		// Small objects growing past the threshold move to a large object
+		// below, which later calls can then resize this way.
+		if(isLarge && sz > LARGE_OBJECT_THRESHOLD) {
+				void * newObject = BigHeap::getInstance().reallocateAtBigHeap(ptr, sz);
+				if(newObject != NULL) {
+						return newObject;
+				}
+		}
+
+		// Small objects shrinking into a smaller class move, so that their
+		// class still follows from their size when they are freed sized.
+		if(oldSize >= sz && (isLarge || BibopHeap::getInstance().isOfClass(ptr, sz))) {
 				return ptr;
 		}
 
 		void * newObject = xxmalloc(sz);
-		memcpy(newObject, ptr, oldSize);
+		if(newObject == NULL) {
+				return NULL;
+		}
+		memcpy(newObject, ptr, (oldSize < sz) ? oldSize : sz);
 		xxfree(ptr);
 		return newObject;
 }
@@ -269,38 +398,323 @@ void * xxalloca(size_t size) {
     return NULL;
 }
 
+// Allocates an object aligned to the given power of two. Small objects come
+// from a class whose objects are all aligned that way, so nothing is wasted
+// beyond the class's own rounding.
+static void * allocateAligned(size_t alignment, size_t size) {
+    if(heapInitStatus != E_HEAP_INIT_DONE) {
+			heapinitialize();
+    }
+
+		// Large alignments are reserved for in full.
+		if(size > SIZE_MAX - alignment - PageSize) {
+				errno = ENOMEM;
+				return NULL;
+		}
+
+		if(!IF_CANARY_CONDITION) {
+				// All small objects are aligned to the smallest class.
+				if(alignment <= BIBOP_MIN_BLOCK_SIZE) {
+						return BibopHeap::getInstance().allocateSmallObject(size);
+				}
+				void * ptr = BibopHeap::getInstance().allocateAlignedSmallObject(size, alignment);
+				if(ptr != NULL) {
+						return ptr;
+				}
+		}
+
+		numLargeObjects++;
+		return BigHeap::getInstance().allocateAlignedAtBigHeap(size, alignment);
+}
+
 void * xxvalloc(size_t size) {
-    PRERR("%s CALLED", __FUNCTION__);
-    return NULL;
+		return allocateAligned(PageSize, size);
 }
 
 int xxposix_memalign(void **memptr, size_t alignment, size_t size) {
-		void * alignedObject = xxmemalign(alignment, size);
+		if(alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+				return EINVAL;
+		}
+		void * alignedObject = allocateAligned(alignment, size);
+		if(alignedObject == NULL) {
+				return ENOMEM;
+		}
 		*memptr = alignedObject;
 		return 0;
 }
 
 void * xxaligned_alloc(size_t alignment, size_t size) {
-    PRERR("%s CALLED", __FUNCTION__);
-    return NULL;
+		if(alignment == 0 || (alignment & (alignment - 1)) != 0) {
+				errno = EINVAL;
+				return NULL;
+		}
+		return allocateAligned(alignment, size);
 }
 
 void * xxmemalign(size_t alignment, size_t size) {
-		if(size == 0) {
-			return NULL;
+		// As with glibc, alignments that are not a power of two are rounded up.
+		if((alignment & (alignment - 1)) != 0) {
+				if(alignment > SIZE_MAX / 2) {
+						errno = EINVAL;
+						return NULL;
+				}
+				alignment = 1UL << (64 - __builtin_clzl(alignment));
 		}
+		return allocateAligned(alignment, size);
+}
 
-		size_t allocObjectSize = alignment + size;
-		void * object = malloc(allocObjectSize);
-		unsigned long residualBytes = (unsigned long)object % alignment;
-		void * alignedObject = (void *)((char *)object + residualBytes);
+void * xxpvalloc(size_t size) {
+		if(size > SIZE_MAX - PageSize) {
+				errno = ENOMEM;
+				return NULL;
+		}
+		return allocateAligned(PageSize, (size == 0) ? PageSize : alignup(size, PageSize));
+}
 
-		return alignedObject;
+// Size classes, for callers that allocate many objects of one size: the class
+// is looked up once, and the heap is initialized by then.
+int freeguard_size_class(size_t size, size_t alignment) {
+    if(heapInitStatus != E_HEAP_INIT_DONE) {
+			heapinitialize();
+    }
+
+		if(IF_CANARY_CONDITION) {
+				return -1;
+		}
+		return BibopHeap::getInstance().getSizeClass(size, alignment);
 }
 
-void * xxpvalloc(size_t size) {
-    PRERR("%s CALLED", __FUNCTION__);
-    return NULL;
+void * freeguard_malloc_class(int sizeClass, size_t size) {
+		return BibopHeap::getInstance().allocateFromClass(sizeClass, size);
+}
+
+void freeguard_free_class(void * ptr, int sizeClass) {
+		if(ptr != NULL) {
+				BibopHeap::getInstance().freeClassObject(ptr, sizeClass);
+		}
+}
+
+// Allocates n objects of the given size into objects[], and returns how many
+// were allocated: all of them, unless memory ran out.
+size_t freeguard_malloc_batch(size_t size, size_t n, void ** objects) {
+    if(heapInitStatus != E_HEAP_INIT_DONE) {
+			heapinitialize();
+    }
+
+		if(!IF_CANARY_CONDITION) {
+				return BibopHeap::getInstance().allocateSmallObjectBatch(size, n, objects);
+		}
+		for(size_t i = 0; i < n; i++) {
+				objects[i] = allocateObject(size, NULL);
+				if(objects[i] == NULL) {
+						return i;
+				}
+		}
+		return n;
+}
+
+// Frees the n objects in objects[]; small objects are freed in batches.
+void freeguard_free_batch(void ** objects, size_t n) {
+		if(heapInitStatus != E_HEAP_INIT_DONE) {
+			return;
+		}
+
+		void * smallObjects[BATCH_FREE_WINDOW];
+		unsigned numSmallObjects = 0;
+		for(size_t i = 0; i < n; i++) {
+				void * ptr = objects[i];
+				if(ptr == NULL) {
+						continue;
+				}
+				if(BibopHeap::getInstance().isSmallObject(ptr)) {
+						smallObjects[numSmallObjects++] = ptr;
+						if(numSmallObjects == BATCH_FREE_WINDOW) {
+								BibopHeap::getInstance().freeSmallObjectBatch(smallObjects, numSmallObjects);
+								numSmallObjects = 0;
+						}
+				} else {
+						xxfree(ptr);
+				}
+		}
+		BibopHeap::getInstance().freeSmallObjectBatch(smallObjects, numSmallObjects);
+}
+
+// Arenas. The arena itself is a small object.
+freeguard_arena * freeguard_arena_create(size_t chunkSize) {
+    if(heapInitStatus != E_HEAP_INIT_DONE) {
+			heapinitialize();
+    }
+
+		if(chunkSize > SIZE_MAX / 2) {
+				errno = EINVAL;
+				return NULL;
+		}
+		Arena * arena = (Arena *)BibopHeap::getInstance().allocateSmallObject(sizeof(Arena));
+		if(arena == NULL) {
+				return NULL;
+		}
+		arena->initialize(chunkSize);
+		return (freeguard_arena *)arena;
+}
+
+void * freeguard_arena_alloc(freeguard_arena * arena, size_t size) {
+		void * ptr = ((Arena *)arena)->allocate(size);
+		if(ptr == NULL) {
+				errno = ENOMEM;
+		}
+		return ptr;
+}
+
+void freeguard_arena_reset(freeguard_arena * arena) {
+		((Arena *)arena)->reset();
+}
+
+void freeguard_arena_destroy(freeguard_arena * arena) {
+		if(arena != NULL) {
+				((Arena *)arena)->destroy();
+				BibopHeap::getInstance().freeSmallObject(arena);
+		}
+}
+
+// Allocates an object for the given tag. Small objects of a tag come from
+// bags of its own when built with TAGGED_HEAPS, otherwise tags only count as
+// valid if 0; large objects are not tagged.
+void * freeguard_malloc_tagged(unsigned tag, size_t size) {
+		if(tag >= BIBOP_TAG_ROWS) {
+				errno = EINVAL;
+				return NULL;
+		}
+		#ifdef TAGGED_HEAPS
+		if(tag != 0 && !IF_CANARY_CONDITION) {
+				if(heapInitStatus != E_HEAP_INIT_DONE) {
+					heapinitialize();
+				}
+				return BibopHeap::getInstance().allocateTaggedObject(size, tag);
+		}
+		#endif
+		return allocateObject(size, NULL);
+}
+
+int freeguard_get_tag_stats(unsigned tag, freeguard_tag_stats * stats) {
+		if(tag == 0 || tag >= BIBOP_TAG_ROWS) {
+				return EINVAL;
+		}
+		#ifdef TAGGED_HEAPS
+		if(heapInitStatus != E_HEAP_INIT_DONE) {
+			heapinitialize();
+		}
+		unsigned long liveBytes, liveObjects;
+		BibopHeap::getInstance().getTagStats(tag, &liveBytes, &liveObjects);
+		stats->live_bytes = liveBytes;
+		stats->live_objects = liveObjects;
+		#endif
+		return 0;
+}
+
+// C++ allocation. The operators call into the heaps directly instead of
+// going through malloc, and sized deletes pass their size on to be checked.
+template <bool nothrow>
+static inline void * allocateForNew(size_t size, size_t alignment) {
+		while(true) {
+				void * ptr = (alignment == 0) ? allocateObject(size, NULL) : allocateAligned(alignment, size);
+				if(ptr != NULL) {
+						return ptr;
+				}
+				std::new_handler handler = std::get_new_handler();
+				if(handler == NULL) {
+						if(nothrow) {
+								return NULL;
+						}
+						throw std::bad_alloc();
+				}
+				if(nothrow) {
+						try {
+								handler();
+						} catch(...) {
+								return NULL;
+						}
+				} else {
+						handler();
+				}
+		}
+}
+
+void * operator new(size_t size) {
+		return allocateForNew<false>(size, 0);
+}
+void * operator new[](size_t size) {
+		return allocateForNew<false>(size, 0);
+}
+void * operator new(size_t size, const std::nothrow_t &) noexcept {
+		return allocateForNew<true>(size, 0);
+}
+void * operator new[](size_t size, const std::nothrow_t &) noexcept {
+		return allocateForNew<true>(size, 0);
+}
+void * operator new(size_t size, std::align_val_t alignment) {
+		return allocateForNew<false>(size, (size_t)alignment);
+}
+void * operator new[](size_t size, std::align_val_t alignment) {
+		return allocateForNew<false>(size, (size_t)alignment);
+}
+void * operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+		return allocateForNew<true>(size, (size_t)alignment);
+}
+void * operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+		return allocateForNew<true>(size, (size_t)alignment);
+}
+
+void operator delete(void * ptr) noexcept {
+		xxfree(ptr);
+}
+void operator delete[](void * ptr) noexcept {
+		xxfree(ptr);
+}
+void operator delete(void * ptr, const std::nothrow_t &) noexcept {
+		xxfree(ptr);
+}
+void operator delete[](void * ptr, const std::nothrow_t &) noexcept {
+		xxfree(ptr);
+}
+void operator delete(void * ptr, size_t size) noexcept {
+		freeSized(ptr, size, 1);
+}
+void operator delete[](void * ptr, size_t size) noexcept {
+		freeSized(ptr, size, 1);
+}
+void operator delete(void * ptr, std::align_val_t) noexcept {
+		xxfree(ptr);
+}
+void operator delete[](void * ptr, std::align_val_t) noexcept {
+		xxfree(ptr);
+}
+void operator delete(void * ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+		xxfree(ptr);
+}
+void operator delete[](void * ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+		xxfree(ptr);
+}
+void operator delete(void * ptr, size_t size, std::align_val_t alignment) noexcept {
+		freeSized(ptr, size, (size_t)alignment);
+}
+void operator delete[](void * ptr, size_t size, std::align_val_t alignment) noexcept {
+		freeSized(ptr, size, (size_t)alignment);
+}
+
+// Size-returning new, as proposed in P0901: returns the object together with
+// its usable size, all of which the caller may use and pass to sized delete.
+__sized_ptr_t __size_returning_new(size_t size) {
+		__sized_ptr_t result;
+		result.p = allocateForNew<false>(size, 0);
+		result.n = xxmalloc_usable_size(result.p);
+		return result;
+}
+
+__sized_ptr_t __size_returning_new_aligned(size_t size, std::align_val_t alignment) {
+		__sized_ptr_t result;
+		result.p = allocateForNew<false>(size, (size_t)alignment);
+		result.n = xxmalloc_usable_size(result.p);
+		return result;
 }
 
 // Intercept thread creation
@@ -314,3 +728,11 @@ int pthread_create(pthread_t * tid, const pthread_attr_t * attr,
 int pthread_join(pthread_t tid, void** retval) {
 	return xthread::getInstance().thread_join(tid, retval);
 }
+int pthread_detach(pthread_t tid) {
+	return xthread::getInstance().thread_detach(tid);
+}
+void pthread_exit(void * retval) {
+	xthread::getInstance().thread_exit(retval);
+	// Real::pthread_exit does not return.
+	__builtin_unreachable();
+}
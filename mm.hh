@@ -25,12 +25,31 @@
 #define __MM_HH__
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+// Guards installed with mprotect() may take up this share of vm.max_map_count;
+// past GUARD_MAP_LOW_SHARE of it, optional guards are placed sparingly.
+#define GUARD_MAP_SHARE 0.5
+#define GUARD_MAP_LOW_SHARE 0.75
+#define DEFAULT_MAX_MAP_COUNT 65530
+
+// How many more mappings guards may still take, see MM::guardPressure().
+enum guardPressure {
+  GUARD_PRESSURE_NONE,
+  GUARD_PRESSURE_LOW,
+  GUARD_PRESSURE_EXHAUSTED
+};
 
 class MM {
 public:
@@ -38,6 +57,13 @@ public:
 
   static void mmapDeallocate(void* ptr, size_t sz) { munmap(ptr, sz); }
 
+  // Resizes a private mapping, moving its pages elsewhere if need be.
+  // Returns NULL if that fails.
+  static void* mmapRemap(void* ptr, size_t oldSize, size_t newSize) {
+    void* newPtr = mremap(ptr, oldSize, newSize, MREMAP_MAYMOVE);
+    return (newPtr == MAP_FAILED) ? NULL : newPtr;
+  }
+
   static void* mmapAllocateShared(size_t sz, int fd = -1, void* startaddr = NULL) {
     return allocate(true, sz, fd, startaddr);
   }
@@ -46,7 +72,113 @@ public:
     return allocate(false, sz, fd, startaddr);
   }
 
+  // Makes the given pages fault on any access. Guard regions installed with
+  // madvise() (Linux 6.13 and later) leave the mapping in one piece, whereas
+  // mprotect() splits it, adding as many as the given number of mappings.
+  // The latter is used where the former is unavailable, as long as guards
+  // stay within their share of vm.max_map_count; beyond that, guards that are
+  // not required are skipped. Returns 0 if the guard is in place.
+  static int guardInstall(void* addr, size_t sz, unsigned mappings = 2, bool required = false) {
+    if(hasGuardAdvice() && madvise(addr, sz, MADV_GUARD_INSTALL) == 0) {
+      return 0;
+    }
+
+    guardAccounting& acct = getGuardAccounting();
+    if(!required && guardPressure() == GUARD_PRESSURE_EXHAUSTED) {
+      guardSkipped(1);
+      return -1;
+    }
+    if(mprotect(addr, sz, PROT_NONE) != 0) {
+      if(errno == ENOMEM) {
+        // Out of mappings sooner than expected; stop adding optional guards.
+        __atomic_store_n(&acct.mappings, acct.budget, __ATOMIC_RELAXED);
+      }
+      guardSkipped(1);
+      return -1;
+    }
+    __atomic_add_fetch(&acct.mappings, mappings, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  // Whether guardInstall() would need mprotect().
+  static bool guardsTakeMappings() {
+    return !hasGuardAdvice();
+  }
+
+  // Accounts for guard-induced mappings that are gone, as their memory was
+  // unmapped.
+  static void guardRemoved(unsigned mappings) {
+    __atomic_sub_fetch(&getGuardAccounting().mappings, mappings, __ATOMIC_RELAXED);
+  }
+
+  static int guardPressure() {
+    guardAccounting& acct = getGuardAccounting();
+    unsigned long mappings = __atomic_load_n(&acct.mappings, __ATOMIC_RELAXED);
+    if(mappings >= acct.budget) {
+      return GUARD_PRESSURE_EXHAUSTED;
+    } else if(mappings >= acct.lowWatermark) {
+      return GUARD_PRESSURE_LOW;
+    }
+    return GUARD_PRESSURE_NONE;
+  }
+
+  // Records guards that were left out to save mappings.
+  static void guardSkipped(unsigned long count) {
+    __atomic_add_fetch(&getGuardAccounting().skipped, count, __ATOMIC_RELAXED);
+  }
+
+  static unsigned long getGuardsSkipped() {
+    return __atomic_load_n(&getGuardAccounting().skipped, __ATOMIC_RELAXED);
+  }
+
 private:
+  struct guardAccounting {
+    // Mappings currently added by guards, and how many they may add.
+    unsigned long mappings;
+    unsigned long budget;
+    unsigned long lowWatermark;
+    unsigned long skipped;
+  };
+
+  static guardAccounting& getGuardAccounting() {
+    static guardAccounting acct;
+    if(acct.budget == 0) {
+      unsigned long maxMapCount = readMaxMapCount();
+      acct.lowWatermark = maxMapCount * GUARD_MAP_SHARE * GUARD_MAP_LOW_SHARE;
+      acct.budget = maxMapCount * GUARD_MAP_SHARE;
+    }
+    return acct;
+  }
+
+  // Reads vm.max_map_count without allocating memory.
+  static unsigned long readMaxMapCount() {
+    unsigned long count = 0;
+    char buf[32];
+    int fd = open("/proc/sys/vm/max_map_count", O_RDONLY);
+    if(fd >= 0) {
+      ssize_t len = read(fd, buf, sizeof(buf));
+      for(ssize_t i = 0; i < len && buf[i] >= '0' && buf[i] <= '9'; i++) {
+        count = count * 10 + (buf[i] - '0');
+      }
+      close(fd);
+    }
+    return (count > 0) ? count : DEFAULT_MAX_MAP_COUNT;
+  }
+
+  // Whether the kernel supports MADV_GUARD_INSTALL, probed on first use.
+  static bool hasGuardAdvice() {
+    static int supported = -1;
+    if(supported == -1) {
+      void* probe = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(probe == MAP_FAILED) {
+        return false;
+      }
+      supported = (madvise(probe, 4096, MADV_GUARD_INSTALL) == 0);
+      munmap(probe, 4096);
+    }
+    return supported;
+  }
+
   static void* allocate(bool isShared, size_t sz, int fd, void* startaddr) {
     int protInfo = PROT_READ | PROT_WRITE;
     int sharedInfo = isShared ? MAP_SHARED : MAP_PRIVATE;
@@ -36,6 +36,8 @@ namespace Real {
 	DEFINE_WRAPPER(pthread_create);
 	DEFINE_WRAPPER(pthread_join);
 	DEFINE_WRAPPER(pthread_kill);
+	DEFINE_WRAPPER(pthread_detach);
+	DEFINE_WRAPPER(pthread_exit);
 
 	void initializer() {
 		INIT_WRAPPER(free, RTLD_NEXT);
@@ -43,10 +45,13 @@ namespace Real {
 		INIT_WRAPPER(malloc, RTLD_NEXT);
 //		INIT_WRAPPER(realloc, RTLD_NEXT);
 		
-		// FIXME about the flags
-		void *pthread_handle = dlopen("libpthread.so.0", RTLD_NOW | RTLD_GLOBAL | RTLD_NOLOAD);
-		INIT_WRAPPER(pthread_create, pthread_handle);
-		INIT_WRAPPER(pthread_join, pthread_handle);
-		INIT_WRAPPER(pthread_kill, pthread_handle);
+		// The pthread functions are looked up past our own definitions as well:
+		// with glibc 2.34 and later they live in libc proper, and a lookup via
+		// dlopen("libpthread.so.0") resolves to our interposed wrappers.
+		INIT_WRAPPER(pthread_create, RTLD_NEXT);
+		INIT_WRAPPER(pthread_join, RTLD_NEXT);
+		INIT_WRAPPER(pthread_kill, RTLD_NEXT);
+		INIT_WRAPPER(pthread_detach, RTLD_NEXT);
+		INIT_WRAPPER(pthread_exit, RTLD_NEXT);
 	}
 }
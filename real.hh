@@ -40,6 +40,8 @@ namespace Real {
   DECLARE_WRAPPER(pthread_create);
   DECLARE_WRAPPER(pthread_join);
   DECLARE_WRAPPER(pthread_kill);
+  DECLARE_WRAPPER(pthread_detach);
+  DECLARE_WRAPPER(pthread_exit);
 };
 
 #endif
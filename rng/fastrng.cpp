@@ -0,0 +1,213 @@
+/*
+ * FreeGuard: A Faster Secure Heap Allocator
+ * Copyright (C) 2017 Sam Silvestro, Hongyu Liu, Corey Crosser,
+ *                    Zhiqiang Lin, and Tongping Liu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * @file   fastrng.cpp: engines refilling the per-thread random number buffers.
+ */
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RNG_X86
+#endif
+#include "fastrng.h"
+
+#ifdef CHACHARNG
+#define KEYSTREAM_ONLY
+#include "chacha_private.h"
+// Key and nonce of the ChaCha20 stream.
+#define CHACHA_SEED_BYTES 40
+#endif
+
+__thread rngBuffer _rngBuffer __attribute__((tls_model("initial-exec")));
+
+// Fills buf with seed material from the kernel, or should that fail, from
+// whatever varies between threads and runs. Does not allocate memory.
+static void rngSeed(void * buf, size_t len) {
+	size_t filled = 0;
+	while(filled < len) {
+		long result = syscall(SYS_getrandom, (char *)buf + filled, len - filled, 0);
+		if(result <= 0) {
+			break;
+		}
+		filled += result;
+	}
+	if(filled == len) {
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t state = now.tv_sec * 1000000000UL + now.tv_nsec;
+	state ^= ((uint64_t)syscall(SYS_gettid) << 32) ^ (uintptr_t)&now;
+	for(size_t i = filled; i < len; i++) {
+		uint64_t z = (state += 0x9e3779b97f4a7c15UL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+		((unsigned char *)buf)[i] ^= (unsigned char)(z ^ (z >> 31));
+	}
+}
+
+#ifdef CHACHARNG
+static void chachaSeed(rngBuffer * buffer, const unsigned char * seed) {
+	chacha_ctx * ctx = (chacha_ctx *)buffer->chacha;
+	chacha_keysetup(ctx, seed, 256, 0);
+	chacha_ivsetup(ctx, seed + 32);
+}
+
+// Fills the buffer with keystream, then rekeys from the keystream right
+// after it so that earlier outputs cannot be recovered from the state.
+static void chachaRefill(rngBuffer * buffer) {
+	unsigned char stream[sizeof(buffer->words) + 64];
+	chacha_encrypt_bytes((chacha_ctx *)buffer->chacha, stream, stream, sizeof(stream));
+	memcpy(buffer->words, stream, sizeof(buffer->words));
+	chachaSeed(buffer, stream + sizeof(buffer->words));
+	memset(stream, 0, sizeof(stream));
+}
+#else
+typedef void (*rngEngine)(rngBuffer *);
+static rngEngine _rngEngine;
+
+static inline uint32_t rotl(uint32_t x, int k) {
+	return (x << k) | (x >> (32 - k));
+}
+
+// All xoshiro128++ engines produce the same sequence: every step yields one
+// word from each lane, in lane order.
+static void xoshiroScalar(rngBuffer * buffer) {
+	uint32_t (*s)[RNG_LANES] = buffer->xoshiro;
+	for(unsigned i = 0; i < RNG_BUFFER_WORDS; i += RNG_LANES) {
+		for(unsigned lane = 0; lane < RNG_LANES; lane++) {
+			buffer->words[i + lane] = rotl(s[0][lane] + s[3][lane], 7) + s[0][lane];
+			uint32_t t = s[1][lane] << 9;
+			s[2][lane] ^= s[0][lane];
+			s[3][lane] ^= s[1][lane];
+			s[1][lane] ^= s[2][lane];
+			s[0][lane] ^= s[3][lane];
+			s[2][lane] ^= t;
+			s[3][lane] = rotl(s[3][lane], 11);
+		}
+	}
+}
+
+#ifdef RNG_X86
+#define XOSHIRO_STEP(vec, add, xor_, sll, srl, or_)                                                 \
+  {                                                                                                 \
+    vec out = add(s0, s3);                                                                          \
+    out = add(or_(sll(out, 7), srl(out, 25)), s0);                                                  \
+    vec t = sll(s1, 9);                                                                             \
+    s2 = xor_(s2, s0);                                                                              \
+    s3 = xor_(s3, s1);                                                                              \
+    s1 = xor_(s1, s2);                                                                              \
+    s0 = xor_(s0, s3);                                                                              \
+    s2 = xor_(s2, t);                                                                               \
+    s3 = or_(sll(s3, 11), srl(s3, 21));                                                             \
+    result = out;                                                                                   \
+	}
+
+static void xoshiroSSE2(rngBuffer * buffer) {
+	for(unsigned half = 0; half < RNG_LANES; half += 4) {
+		__m128i s0 = _mm_loadu_si128((__m128i *)&buffer->xoshiro[0][half]);
+		__m128i s1 = _mm_loadu_si128((__m128i *)&buffer->xoshiro[1][half]);
+		__m128i s2 = _mm_loadu_si128((__m128i *)&buffer->xoshiro[2][half]);
+		__m128i s3 = _mm_loadu_si128((__m128i *)&buffer->xoshiro[3][half]);
+		__m128i result;
+		for(unsigned i = 0; i < RNG_BUFFER_WORDS; i += RNG_LANES) {
+			XOSHIRO_STEP(__m128i, _mm_add_epi32, _mm_xor_si128, _mm_slli_epi32, _mm_srli_epi32, _mm_or_si128);
+			_mm_storeu_si128((__m128i *)&buffer->words[i + half], result);
+		}
+		_mm_storeu_si128((__m128i *)&buffer->xoshiro[0][half], s0);
+		_mm_storeu_si128((__m128i *)&buffer->xoshiro[1][half], s1);
+		_mm_storeu_si128((__m128i *)&buffer->xoshiro[2][half], s2);
+		_mm_storeu_si128((__m128i *)&buffer->xoshiro[3][half], s3);
+	}
+}
+
+__attribute__((target("avx2")))
+static void xoshiroAVX2(rngBuffer * buffer) {
+	__m256i s0 = _mm256_loadu_si256((__m256i *)buffer->xoshiro[0]);
+	__m256i s1 = _mm256_loadu_si256((__m256i *)buffer->xoshiro[1]);
+	__m256i s2 = _mm256_loadu_si256((__m256i *)buffer->xoshiro[2]);
+	__m256i s3 = _mm256_loadu_si256((__m256i *)buffer->xoshiro[3]);
+	__m256i result;
+	for(unsigned i = 0; i < RNG_BUFFER_WORDS; i += RNG_LANES) {
+		XOSHIRO_STEP(__m256i, _mm256_add_epi32, _mm256_xor_si256, _mm256_slli_epi32, _mm256_srli_epi32, _mm256_or_si256);
+		_mm256_storeu_si256((__m256i *)&buffer->words[i], result);
+	}
+	_mm256_storeu_si256((__m256i *)buffer->xoshiro[0], s0);
+	_mm256_storeu_si256((__m256i *)buffer->xoshiro[1], s1);
+	_mm256_storeu_si256((__m256i *)buffer->xoshiro[2], s2);
+	_mm256_storeu_si256((__m256i *)buffer->xoshiro[3], s3);
+}
+#endif
+
+static rngEngine selectEngine() {
+	#ifdef RNG_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		return xoshiroAVX2;
+	}
+	if(__builtin_cpu_supports("sse2")) {
+		return xoshiroSSE2;
+	}
+	#endif
+	return xoshiroScalar;
+}
+#endif
+
+void rngRefill(rngBuffer * buffer) {
+	if(!buffer->seeded) {
+		#ifdef CHACHARNG
+		unsigned char seed[CHACHA_SEED_BYTES];
+		rngSeed(seed, sizeof(seed));
+		chachaSeed(buffer, seed);
+		memset(seed, 0, sizeof(seed));
+		#else
+		rngSeed(buffer->xoshiro, sizeof(buffer->xoshiro));
+		// No lane may start out with an all-zero state.
+		for(unsigned lane = 0; lane < RNG_LANES; lane++) {
+			buffer->xoshiro[0][lane] |= 1;
+		}
+		#endif
+		buffer->seeded = true;
+	}
+
+	#ifdef CHACHARNG
+	chachaRefill(buffer);
+	#else
+	if(_rngEngine == NULL) {
+		_rngEngine = selectEngine();
+	}
+	_rngEngine(buffer);
+	#endif
+	buffer->count = RNG_BUFFER_WORDS;
+}
+
+// A child would otherwise go on with the same numbers as its parent.
+static void rngAfterFork() {
+	_rngBuffer.count = 0;
+	_rngBuffer.seeded = false;
+}
+
+void rngInitialize() {
+	pthread_atfork(NULL, NULL, rngAfterFork);
+}
@@ -0,0 +1,60 @@
+/*
+ * FreeGuard: A Faster Secure Heap Allocator
+ * Copyright (C) 2017 Sam Silvestro, Hongyu Liu, Corey Crosser,
+ *                    Zhiqiang Lin, and Tongping Liu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * @file   fastrng.h: per-thread buffers of random numbers.
+ */
+#ifndef FASTRNG_H
+#define FASTRNG_H
+
+#include <stdint.h>
+
+// Random numbers are handed out from a per-thread buffer, which is refilled
+// in bulk by one of the engines in fastrng.cpp: xoshiro128++ run in
+// RNG_LANES independent lanes (using AVX2 or SSE2 where the CPU has them),
+// or ChaCha20 when built with CHACHARNG.
+#define RNG_BUFFER_WORDS 256
+#define RNG_LANES 8
+
+struct rngBuffer {
+	uint32_t words[RNG_BUFFER_WORDS];
+	// The number of words not handed out yet, which are taken from the end.
+	unsigned count;
+	bool seeded;
+	#ifdef CHACHARNG
+	uint32_t chacha[16];
+	#else
+	uint32_t xoshiro[4][RNG_LANES];
+	#endif
+};
+
+extern __thread rngBuffer _rngBuffer __attribute__((tls_model("initial-exec")));
+
+void rngRefill(rngBuffer * buffer);
+// Sets up reseeding in children after fork(); may allocate memory.
+void rngInitialize();
+
+static inline uint32_t rngNext() {
+	rngBuffer * buffer = &_rngBuffer;
+	if(__builtin_expect(buffer->count == 0, 0)) {
+		rngRefill(buffer);
+	}
+	return buffer->words[--buffer->count];
+}
+
+#endif
@@ -68,6 +68,34 @@ inline void* removeSLLHead(slist_t* slist) {
 	return temp;
 }
 
+/*
+ * Lock-free operations for a list shared by any number of producers and a
+ * single consumer. Producers only ever push, and the consumer only ever
+ * detaches the entire list, so there is no ABA problem: a successful
+ * compare-and-swap always observes the head it linked the node to.
+ */
+inline void atomicInsertSLLHead(slist_t* node, slist_t* slist) {
+	slist_t * head = __atomic_load_n(&slist->next, __ATOMIC_RELAXED);
+	do {
+		node->next = head;
+	} while(!__atomic_compare_exchange_n(&slist->next, &head, node, true,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Push the chain first ... last as a whole.
+inline void atomicInsertAllSLLHead(slist_t* first, slist_t* last, slist_t* slist) {
+	slist_t * head = __atomic_load_n(&slist->next, __ATOMIC_RELAXED);
+	do {
+		last->next = head;
+	} while(!__atomic_compare_exchange_n(&slist->next, &head, first, true,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Detach all entries of a shared list, returning the first of them.
+inline slist_t * atomicRemoveAllSLL(slist_t* slist) {
+	return __atomic_exchange_n(&slist->next, (slist_t *)NULL, __ATOMIC_ACQUIRE);
+}
+
 inline slist_t * getTailSLL(slist_t *slist) {
   if(slist == NULL) {
     return NULL;
@@ -0,0 +1,69 @@
+/*
+ * Exercises aligned allocation against a build of the library with assertions
+ * enabled; see the test target of the Makefile.
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+#define PAGE_SIZE 4096
+
+static void checkObject(void * ptr, size_t alignment, size_t size) {
+	CHECK(ptr != NULL);
+	CHECK(((uintptr_t)ptr & (alignment - 1)) == 0);
+	CHECK(malloc_usable_size(ptr) >= size);
+	memset(ptr, 0xab, size);
+}
+
+int main() {
+	// Small and large objects, with alignments up to beyond the largest class.
+	static const size_t sizes[] = { 1, 24, 100, 4000, 9000, 70000, 5 << 20 };
+	for(size_t alignment = 8; alignment <= (1 << 22); alignment <<= 1) {
+		for(unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			size_t size = sizes[i];
+			void * ptr;
+
+			ptr = memalign(alignment, size);
+			checkObject(ptr, alignment, size);
+			free(ptr);
+
+			ptr = aligned_alloc(alignment, size);
+			checkObject(ptr, alignment, size);
+			free(ptr);
+
+			ptr = NULL;
+			CHECK(posix_memalign(&ptr, alignment, size) == 0);
+			checkObject(ptr, alignment, size);
+			free(ptr);
+		}
+	}
+
+	void * ptr = valloc(100);
+	checkObject(ptr, PAGE_SIZE, 100);
+	free(ptr);
+	ptr = pvalloc(100);
+	checkObject(ptr, PAGE_SIZE, PAGE_SIZE);
+	free(ptr);
+
+	// Alignments that are not powers of two.
+	CHECK(posix_memalign(&ptr, 24, 100) == EINVAL);
+	CHECK(posix_memalign(&ptr, 4, 100) == EINVAL);
+	errno = 0;
+	CHECK(aligned_alloc(24, 100) == NULL && errno == EINVAL);
+	ptr = memalign(24, 100);
+	checkObject(ptr, 32, 100);
+	free(ptr);
+
+	printf("aligned: ok\n");
+	return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Exercises arenas against a build of the library with assertions enabled;
+ * see the test target of the Makefile.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freeguard.h"
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+int main() {
+	// Chunks of the default size are well below the large object threshold.
+	freeguard_arena * arena = freeguard_arena_create(0);
+	CHECK(arena != NULL);
+	for(int round = 0; round < 100; round++) {
+		for(int i = 0; i < 2000; i++) {
+			size_t size = (i % 50) * 8 + 1;
+			char * ptr = freeguard_arena_alloc(arena, size);
+			CHECK(ptr != NULL && ((uintptr_t)ptr & 15) == 0);
+			memset(ptr, round, size);
+		}
+		// An object with a chunk of its own.
+		char * ptr = freeguard_arena_alloc(arena, 1 << 20);
+		CHECK(ptr != NULL);
+		memset(ptr, round, 1 << 20);
+		freeguard_arena_reset(arena);
+	}
+	freeguard_arena_destroy(arena);
+
+	// Chunks of a single page.
+	arena = freeguard_arena_create(1);
+	for(int i = 0; i < 10000; i++) {
+		CHECK(freeguard_arena_alloc(arena, i % 3000) != NULL);
+	}
+	freeguard_arena_reset(arena);
+	CHECK(freeguard_arena_alloc(arena, 5000) != NULL);
+	freeguard_arena_destroy(arena);
+
+	arena = freeguard_arena_create(0);
+	CHECK(freeguard_arena_alloc(arena, SIZE_MAX - 10) == NULL);
+	freeguard_arena_destroy(arena);
+
+	printf("arena: ok\n");
+	return 0;
+}
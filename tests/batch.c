@@ -0,0 +1,60 @@
+/*
+ * Exercises batch allocation against a build of the library with assertions
+ * enabled; see the test target of the Makefile.
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freeguard.h"
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+#define NUM_OBJECTS 5000
+
+static int compare(const void * a, const void * b) {
+	uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void * objects[NUM_OBJECTS];
+static void * sorted[NUM_OBJECTS];
+
+int main() {
+	static const size_t sizes[] = { 1, 16, 24, 100, 1000, 4096, 70000, 5 << 20 };
+	for(unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t size = sizes[i];
+		size_t count = (size > 65536) ? 20 : NUM_OBJECTS;
+		for(int round = 0; round < 3; round++) {
+			CHECK(freeguard_malloc_batch(size, count, objects) == count);
+			for(size_t j = 0; j < count; j++) {
+				CHECK(objects[j] != NULL && malloc_usable_size(objects[j]) >= size);
+				memset(objects[j], j, size);
+			}
+
+			// No object is handed out twice.
+			memcpy(sorted, objects, count * sizeof(void *));
+			qsort(sorted, count, sizeof(void *), compare);
+			for(size_t j = 1; j < count; j++) {
+				CHECK(sorted[j] != sorted[j - 1]);
+			}
+			freeguard_free_batch(objects, count);
+		}
+	}
+
+	// Batches mixing small, large and null objects from malloc.
+	for(size_t j = 0; j < NUM_OBJECTS; j++) {
+		objects[j] = (j % 7 == 0) ? NULL : malloc((j % 500 == 1) ? (5 << 20) : j % 300 + 1);
+	}
+	freeguard_free_batch(objects, NUM_OBJECTS);
+	freeguard_free_batch(objects, 0);
+
+	printf("batch: ok\n");
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Exercises the C++ allocation operators against a build of the library with
+ * assertions enabled; see the test target of the Makefile.
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+extern "C" {
+	typedef struct {
+		void * p;
+		size_t n;
+	} __sized_ptr_t;
+	__sized_ptr_t __size_returning_new(size_t);
+}
+
+struct alignas(64) Line {
+	char bytes[64];
+};
+
+struct alignas(4096) Page {
+	char bytes[100];
+};
+
+// Keeps the compiler from eliding allocations along with their results.
+static void * volatile sink;
+
+// A size that cannot be allocated, hidden from the compiler's size checks.
+static volatile size_t hugeSize = SIZE_MAX - 10;
+
+static int handlerCalls;
+
+static void failingHandler() {
+	handlerCalls++;
+	std::set_new_handler(nullptr);
+}
+
+int main() {
+	for(size_t size = 1; size < (1 << 23); size += size / 3 + 1) {
+		char * ptr = (char *)::operator new(size);
+		CHECK(malloc_usable_size(ptr) >= size);
+		memset(ptr, 1, size);
+		::operator delete(ptr, size);
+
+		ptr = new char[size];
+		memset(ptr, 1, size);
+		sink = ptr;
+		delete[] ptr;
+
+		for(size_t alignment = 16; alignment <= 65536; alignment <<= 2) {
+			ptr = (char *)::operator new(size, std::align_val_t(alignment));
+			CHECK(((uintptr_t)ptr & (alignment - 1)) == 0);
+			CHECK(malloc_usable_size(ptr) >= size);
+			memset(ptr, 1, size);
+			::operator delete(ptr, size, std::align_val_t(alignment));
+		}
+
+		__sized_ptr_t sized = __size_returning_new(size);
+		CHECK(sized.p != NULL && sized.n >= size);
+		memset(sized.p, 1, sized.n);
+		::operator delete(sized.p, sized.n);
+	}
+
+	Line * lines = new Line[10];
+	sink = lines;
+	CHECK(((uintptr_t)lines & 63) == 0);
+	delete[] lines;
+	Page * page = new Page;
+	sink = page;
+	CHECK(((uintptr_t)page & 4095) == 0);
+	delete page;
+
+	// Sizes that cannot be allocated.
+	sink = ::operator new(hugeSize, std::nothrow);
+	CHECK(sink == nullptr);
+	sink = ::operator new(hugeSize, std::align_val_t(64), std::nothrow);
+	CHECK(sink == nullptr);
+	bool thrown = false;
+	try {
+		sink = ::operator new(hugeSize);
+	} catch(const std::bad_alloc &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	// The new handler is called until it gives up.
+	std::set_new_handler(failingHandler);
+	sink = ::operator new(hugeSize, std::nothrow);
+	CHECK(sink == nullptr);
+	CHECK(handlerCalls == 1);
+
+	printf("new: ok\n");
+	return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Exercises size classes, the memory resource and the allocator against a
+ * build of the library with assertions enabled; see the test target of the
+ * Makefile.
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <vector>
+#include "freeguard.h"
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+struct alignas(64) Line {
+	char bytes[64];
+};
+
+int main() {
+	// Objects of a class, which fit the sizes they were looked up for.
+	for(size_t size = 1; size < 4096; size += size / 4 + 1) {
+		for(size_t alignment = 1; alignment <= 256; alignment <<= 2) {
+			int sizeClass = freeguard_size_class(size, alignment);
+			CHECK(sizeClass >= 0);
+			void * objects[100];
+			for(int i = 0; i < 100; i++) {
+				objects[i] = freeguard_malloc_class(sizeClass, size);
+				CHECK(objects[i] != NULL && ((uintptr_t)objects[i] & (alignment - 1)) == 0);
+				CHECK(malloc_usable_size(objects[i]) >= size);
+				memset(objects[i], i, size);
+			}
+			for(int i = 0; i < 100; i++) {
+				freeguard_free_class(objects[i], sizeClass);
+			}
+		}
+	}
+	CHECK(freeguard_size_class(64 << 20, 1) == -1);
+	freeguard_free_class(NULL, 0);
+
+	// A size beyond the class is fatal.
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if(pid == 0) {
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+		freeguard_malloc_class(freeguard_size_class(16, 1), 4000);
+		_exit(EXIT_SUCCESS);
+	}
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS);
+
+	// The resource, for objects of any size and alignment.
+	std::pmr::memory_resource * resource = freeguard::get_memory_resource();
+	CHECK(resource->is_equal(*freeguard::get_memory_resource()));
+	CHECK(!resource->is_equal(*std::pmr::new_delete_resource()));
+	static const size_t sizes[] = { 1, 40, 1000, 5000, 5 << 20 };
+	for(unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for(size_t alignment = 8; alignment <= 8192; alignment <<= 1) {
+			void * ptr = resource->allocate(sizes[i], alignment);
+			CHECK(((uintptr_t)ptr & (alignment - 1)) == 0);
+			memset(ptr, 1, sizes[i]);
+			resource->deallocate(ptr, sizes[i], alignment);
+		}
+	}
+
+	{
+		std::pmr::vector<std::pmr::string> strings(resource);
+		std::pmr::map<int, std::pmr::string> numbers(resource);
+		for(int i = 0; i < 10000; i++) {
+			strings.emplace_back(100 + i % 50, 'x');
+			numbers.emplace(i, std::to_string(i).c_str());
+		}
+		CHECK(strings[9999].size() == 100 + 9999 % 50);
+		CHECK(numbers[1234] == "1234");
+	}
+
+	// The allocator, for node-based containers and others.
+	{
+		std::list<Line, freeguard::allocator<Line>> lines(1000);
+		for(const Line & line : lines) {
+			CHECK(((uintptr_t)&line & 63) == 0);
+		}
+		std::map<int, int, std::less<int>, freeguard::allocator<std::pair<const int, int>>> squares;
+		for(int i = 0; i < 10000; i++) {
+			squares[i] = i * i;
+		}
+		CHECK(squares[300] == 90000);
+		std::vector<int, freeguard::allocator<int>> numbers;
+		for(int i = 0; i < 100000; i++) {
+			numbers.push_back(i);
+		}
+		CHECK(numbers[54321] == 54321);
+		CHECK(freeguard::allocator<int>() == freeguard::allocator<Line>());
+	}
+
+	printf("pmr: ok\n");
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Exercises usable sizes and sized frees against a build of the library with
+ * assertions enabled; see the test target of the Makefile.
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "freeguard.h"
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+void free_sized(void * ptr, size_t size);
+void free_aligned_sized(void * ptr, size_t alignment, size_t size);
+
+int main() {
+	for(size_t size = 1; size < (1 << 23); size += size / 3 + 1) {
+		size_t usableSize = freeguard_nallocx(size, 0);
+		CHECK(usableSize >= size);
+		char * ptr = malloc(size);
+		CHECK(ptr != NULL);
+		CHECK(malloc_usable_size(ptr) == usableSize);
+		memset(ptr, 1, usableSize);
+		free_sized(ptr, size);
+
+		for(int lgAlignment = 4; lgAlignment <= 16; lgAlignment += 4) {
+			size_t alignment = 1UL << lgAlignment;
+			usableSize = freeguard_nallocx(size, lgAlignment);
+			CHECK(usableSize >= size);
+			ptr = aligned_alloc(alignment, size);
+			CHECK(ptr != NULL && ((uintptr_t)ptr & (alignment - 1)) == 0);
+			CHECK(malloc_usable_size(ptr) == usableSize);
+			memset(ptr, 1, usableSize);
+			free_aligned_sized(ptr, alignment, size);
+		}
+	}
+	CHECK(freeguard_nallocx(SIZE_MAX - 10, 0) == 0);
+	CHECK(malloc_usable_size(NULL) == 0);
+	free_sized(NULL, 100);
+
+	// A size of another class is fatal.
+	pid_t pid = fork();
+	CHECK(pid >= 0);
+	if(pid == 0) {
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+		free_sized(malloc(16), 4000);
+		_exit(EXIT_SUCCESS);
+	}
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS);
+
+	printf("sizing: ok\n");
+	return 0;
+}
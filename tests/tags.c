@@ -0,0 +1,76 @@
+/*
+ * Exercises tagged allocation against a build of the library with assertions
+ * enabled; see the test target of the Makefile. Builds without TAGGED_HEAPS
+ * only take tag 0.
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freeguard.h"
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+#define NUM_TAGS 8
+#define NUM_OBJECTS 1000
+
+static void * objects[NUM_OBJECTS];
+
+int main() {
+	freeguard_tag_stats stats;
+	errno = 0;
+	CHECK(freeguard_malloc_tagged(NUM_TAGS, 16) == NULL && errno == EINVAL);
+	CHECK(freeguard_get_tag_stats(NUM_TAGS, &stats) == EINVAL);
+	CHECK(freeguard_get_tag_stats(0, &stats) == EINVAL);
+	void * ptr = freeguard_malloc_tagged(0, 16);
+	CHECK(ptr != NULL);
+	free(ptr);
+
+	if(freeguard_get_tag_stats(1, &stats) == EINVAL) {
+		errno = 0;
+		CHECK(freeguard_malloc_tagged(1, 16) == NULL && errno == EINVAL);
+		printf("tags: ok (untagged build)\n");
+		return 0;
+	}
+
+	for(unsigned tag = 1; tag < NUM_TAGS; tag++) {
+		freeguard_tag_stats before, after;
+		CHECK(freeguard_get_tag_stats(tag, &before) == 0);
+		size_t size = 8 << tag;
+		for(int i = 0; i < NUM_OBJECTS; i++) {
+			objects[i] = freeguard_malloc_tagged(tag, size);
+			CHECK(objects[i] != NULL && malloc_usable_size(objects[i]) >= size);
+			memset(objects[i], tag, size);
+		}
+		CHECK(freeguard_get_tag_stats(tag, &after) == 0);
+		CHECK(after.live_objects == before.live_objects + NUM_OBJECTS);
+		CHECK(after.live_bytes >= before.live_bytes + NUM_OBJECTS * size);
+
+		// Other tags do not count these objects.
+		freeguard_tag_stats other;
+		CHECK(freeguard_get_tag_stats(tag % (NUM_TAGS - 1) + 1, &other) == 0);
+		CHECK(other.live_objects == 0);
+
+		for(int i = 0; i < NUM_OBJECTS; i++) {
+			free(objects[i]);
+		}
+		CHECK(freeguard_get_tag_stats(tag, &after) == 0);
+		CHECK(after.live_objects == before.live_objects);
+		CHECK(after.live_bytes == before.live_bytes);
+	}
+
+	// Large objects are not tagged.
+	ptr = freeguard_malloc_tagged(1, 5 << 20);
+	CHECK(ptr != NULL);
+	CHECK(freeguard_get_tag_stats(1, &stats) == 0 && stats.live_objects == 0);
+	free(ptr);
+
+	printf("tags: ok\n");
+	return 0;
+}
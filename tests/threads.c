@@ -0,0 +1,62 @@
+/*
+ * Exercises the recycling of thread slots against a build of the library with
+ * assertions enabled; see the test target of the Makefile.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(EXIT_FAILURE); \
+	} \
+} while(0)
+
+// Far more threads than there are slots, each exiting one of four ways.
+#define NUM_THREADS 3000
+
+enum { JOINED, CREATED_DETACHED, JOINED_EXIT, DETACHED_EXIT };
+
+static int finished;
+
+static void * work(void * arg) {
+	long how = (long)arg;
+	if(how == DETACHED_EXIT) {
+		pthread_detach(pthread_self());
+	}
+	for(int i = 0; i < 100; i++) {
+		char * ptr = malloc(16 + i * 8);
+		CHECK(ptr != NULL);
+		memset(ptr, i, 16 + i * 8);
+		free(ptr);
+	}
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+	if(how == JOINED_EXIT || how == DETACHED_EXIT) {
+		pthread_exit(NULL);
+	}
+	return NULL;
+}
+
+int main() {
+	pthread_attr_t detached;
+	pthread_attr_init(&detached);
+	pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+
+	for(int i = 0; i < NUM_THREADS; i++) {
+		pthread_t thread;
+		long how = i % 4;
+		CHECK(pthread_create(&thread, (how == CREATED_DETACHED) ? &detached : NULL, work, (void *)how) == 0);
+		if(how == JOINED || how == JOINED_EXIT) {
+			CHECK(pthread_join(thread, NULL) == 0);
+		}
+		while(__atomic_load_n(&finished, __ATOMIC_ACQUIRE) <= i) {
+			usleep(100);
+		}
+	}
+
+	printf("threads: ok\n");
+	return 0;
+}
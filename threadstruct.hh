@@ -35,6 +35,12 @@ extern "C" {
 				// Whether the entry is available so that allocThreadIndex can use this one
 				bool available;
 
+				// An entry whose thread is detached becomes reusable once the thread
+				// has exited; see xthread::isReclaimable().
+				bool created;
+				bool detached;
+				bool exited;
+
 				// Identifications
 				pid_t tid;
 				pthread_t pthreadt;
@@ -106,25 +106,63 @@ inline size_t aligndown(size_t addr, size_t alignto) { return (addr & ~(alignto
 #define FREELIST_REMOVE   removeSLLHead
 #define FREELIST_TYPE     slist_t
 #endif
+#ifdef LOCKFREE_FREELIST
+#warning lock-free freelists in use
+#endif
+#ifdef CFREELIST
+#warning batched remote frees in use
+// Objects a thread gathers for one remote bag set before handing them over.
+#define REMOTE_FREE_BATCH 32
+// Number of remote bag sets a thread can gather objects for at a time.
+#define REMOTE_FREE_SLOTS_SHIFT 4
+#define REMOTE_FREE_SLOTS (1 << REMOTE_FREE_SLOTS_SHIFT)
+#endif
+// Objects freed by a thread other than the owner of their bag are passed to
+// the owner through a per-bag-set lock-free list, rather than being placed
+// on the owner's freelist under its lock.
+#if defined(LOCKFREE_FREELIST) || defined(CFREELIST)
+#define REMOTE_FREELIST
+#endif
+// The shadow entry of an allocated object holds one of the following tags in
+// place of a freelist pointer; freelist pointers never have the low bit set.
 #define ALLOC_SENTINEL (slist_t *)0x1
+// Allocated, but the object fills its class exactly and therefore has no
+// in-line canary; its canary is kept out of line instead, see
+// BibopHeap::checkOutOfLineCanary().
+#define ALLOC_SENTINEL_NOCANARY (slist_t *)0x3
+#define ALLOC_SENTINEL_TAG 0x1
 #ifdef USE_CANARY
 	#warning canary value in use
 	#define CANARY_SENTINEL 0x7B
 	#define NUM_MORE_CANARIES_TO_CHECK 2
-	#define IF_CANARY_CONDITION ((size + 1) > LARGE_OBJECT_THRESHOLD)
+	#ifdef PADDED_CANARIES
+	// Every request is given room for its in-line canary when its class is
+	// chosen, at the cost of going up a class at exact fits.
+	#warning padded canaries in use
+	#define CANARY_ROOM 1
+	#else
+	// The in-line canary only occupies slack at the end of a size class.
+	#define CANARY_ROOM 0
+	#endif
 #else
-	#define IF_CANARY_CONDITION (size > LARGE_OBJECT_THRESHOLD)
+	#define CANARY_ROOM 0
 #endif
+#define IF_CANARY_CONDITION (size > LARGE_OBJECT_THRESHOLD - CANARY_ROOM)
 
-#ifdef SSE2RNG
-#define RNG_MAX 0x8000
-#define SRAND(x) srand_sse(x)
-#else
-#define RNG_MAX RAND_MAX
-#define SRAND(x) srand(x)
-#endif
-#define MAX_ALIVE_THREADS 128
-#define BIBOP_NUM_HEAPS 1024
+#define MAX_ALIVE_THREADS 1024
+// The heap area is divided into heaps of one subheap per thread, whose number
+// is picked at startup (see BibopHeap::initSubHeapCount()). The heaps are as
+// many as fit into this much address space, whatever the size of their bags.
+#define BIBOP_HEAP_AREA_SIZE (1UL << 46)	// 64TB
+// By default, the first 128 thread indices get subheaps of their own, as
+// they did with one subheap per thread; the shared ones come on top.
+#define BIBOP_MIN_SUBHEAPS 256
+#define BIBOP_MAX_SUBHEAPS 1024
+#define BIBOP_SUBHEAPS_ENV "FREEGUARD_SUBHEAPS"
+// When there are fewer subheaps than thread indices, this fraction of the
+// subheaps is shared among all threads beyond the dedicated ones.
+#define BIBOP_SHARED_SUBHEAP_RATIO 8
+#define BIBOP_SHARED_OWNER ((unsigned)-1)
 //#warning reduced BIBOP_BAG_SET_SIZE from 4 to 1
 //#define BIBOP_BAG_SET_SIZE 1
 #define BIBOP_BAG_SET_SIZE 4
@@ -133,7 +171,6 @@ inline size_t aligndown(size_t addr, size_t alignto) { return (addr & ~(alignto
 #define BIBOP_BAG_SET_RANDOMIZER_MASK (BIBOP_BAG_SET_RANDOMIZER - 1)
 #define BIBOP_BAG_SET_MASK (BIBOP_BAG_SET_SIZE - 1)
 
-#define CACHEDFREELIST_THRESHOLD_RATIO_BYBAG 10
 #define PAGESIZE 0x1000
 #define CACHE_LINE_SIZE 64
 
@@ -171,17 +208,135 @@ inline size_t aligndown(size_t addr, size_t alignto) { return (addr & ~(alignto
 	#define LARGE_OBJECT_THRESHOLD 0x80000	// 512KB
 #endif
 
-#define BIBOP_NUM_SUBHEAPS MAX_ALIVE_THREADS
+// Size classes are generated between each pair of powers of two in steps
+// of 1/BIBOP_CLASS_STEPS of the lower power (but never finer than
+// BIBOP_MIN_BLOCK_SIZE), smallest classes first, for as long as spare bags
+// remain. One spare bag is always kept to serve as the trailing guard area.
+#define BIBOP_CLASS_STEPS 4
+// Requests up to this size are mapped to their class by table lookup;
+// every class above it must be a power of two.
+#define BIBOP_CLASS_LOOKUP_MAX 4096
+#define BIBOP_CLASS_LOOKUP_ENTRIES ((BIBOP_CLASS_LOOKUP_MAX / BIBOP_MIN_BLOCK_SIZE) + 1)
+// Objects are located by multiplying bag offsets with a fixed-point
+// reciprocal of their class size rather than by shifting.
+#define BIBOP_CLASS_MAGIC_SHIFT_BITS 32
+
+#ifdef TAGGED_HEAPS
+#warning tagged bags in use
+// Each subheap has a row of bags per tag, the first for untagged objects.
+#define BIBOP_TAG_ROWS 8
+// The rows of tags 1 and up take heaps of their own past the untagged heaps,
+// as many as fit into this much address space per tag, but at least one per
+// bag set.
+#define BIBOP_TAG_AREA_SIZE (1UL << 40)	// 1TB
+#else
+#define BIBOP_TAG_ROWS 1
+#endif
 #define BIBOP_SUBHEAP_SIZE (long long)(BIBOP_NUM_BAGS * _bibopBagSize)
-#define BIBOP_HEAP_SIZE (long long)(BIBOP_SUBHEAP_SIZE * BIBOP_NUM_SUBHEAPS)
+#define BIBOP_HEAP_SIZE (long long)(BIBOP_SUBHEAP_SIZE * _numSubHeaps)
 #define PageSize 4096UL
 #define PageMask (PageSize - 1)
 #define PageSizeShiftBits 12
 #define RANDOM_GUARD_PROP 0.1		// 10% random guard pages per bag
-#define RANDOM_GUARD_RAND_CUTOFF (RANDOM_GUARD_PROP * RNG_MAX)
+// Random guards are decided and installed for a chunk of a bag at a time,
+// which holds at most 64 guard units (pages, or objects of a page or larger).
+#define RANDOM_GUARD_CHUNK_SIZE 0x40000		// 256KB
+#define RANDOM_GUARD_CHUNK_CUTOFF (unsigned long)(RANDOM_GUARD_PROP * (1UL << 32))
+#ifdef GUARD_HELPER_THREAD
+#ifndef RANDOM_GUARD
+#undef GUARD_HELPER_THREAD
+#else
+// Pending chunks the guard helper thread can be asked to install, and how
+// many chunks it is kept ahead of each bump pointer.
+#define GUARD_REQUEST_QUEUE_SIZE 256
+#define GUARD_HELPER_LOOKAHEAD 4
+// Once out of work, the helper polls for new requests this often (in ns),
+// and after this many empty polls sleeps until it is woken up.
+#define GUARD_HELPER_POLL_NS 200000
+#define GUARD_HELPER_IDLE_POLLS 50
+#endif
+#endif
 #define BIBOP_GUARD_PAGE_MAP_SIZE 16
 #define BIBOP_GUARD_PAGE_MAP_SIZE_MASK (BIBOP_GUARD_PAGE_MAP_SIZE - 1)
 #define THREAD_MAP_SIZE	1280
+// Large objects are found through a two-level map of the pages of the
+// address space that they start in.
+#define BIG_PAGE_MAP_ADDRESS_BITS 47
+#define BIG_PAGE_MAP_LEAF_BITS 18
+#define BIG_PAGE_MAP_LEAF_ENTRIES (1UL << BIG_PAGE_MAP_LEAF_BITS)
+#define BIG_PAGE_MAP_ROOT_ENTRIES (1UL << (BIG_PAGE_MAP_ADDRESS_BITS - PageSizeShiftBits - BIG_PAGE_MAP_LEAF_BITS))
+// The bits of the flags of freeguard_nallocx() holding the log2 of the alignment.
+#define NALLOCX_LG_ALIGN_MASK 0x3f
+// Large objects end at a guard page of their own.
+#ifdef ENABLE_GUARDPAGE
+#define BIG_GUARD_SIZE PageSize
+#else
+#define BIG_GUARD_SIZE 0
+#endif
+
+#ifdef BIG_MAPPING_CACHE
+#warning freed large object mappings are cached for reuse
+// Mappings of up to BIG_CACHE_MAX_SIZE are sized in BIG_CACHE_CLASS_STEPS
+// classes per power of two, from LARGE_OBJECT_THRESHOLD on.
+#define BIG_CACHE_MIN_PAGES (LARGE_OBJECT_THRESHOLD >> PageSizeShiftBits)
+#define BIG_CACHE_MAX_SIZE 0x2000000	// 32MB
+#define BIG_CACHE_CLASS_STEPS 4
+#define BIG_CACHE_BUCKETS ((LOG2(BIG_CACHE_MAX_SIZE >> PageSizeShiftBits) - LOG2(BIG_CACHE_MIN_PAGES)) * BIG_CACHE_CLASS_STEPS + 1)
+// Bytes of mappings kept by each thread, and by all threads together.
+#define BIG_CACHE_THREAD_BYTES 0x2000000	// 32MB
+#define BIG_CACHE_BYTES 0x10000000	// 256MB
+// Cached mappings older than this (in ms) are unmapped, which is checked
+// by each thread at most every BIG_CACHE_TRIM_INTERVAL_MS.
+#define BIG_CACHE_MAX_AGE_MS 1000
+#define BIG_CACHE_TRIM_INTERVAL_MS 100
+#endif
+
+#ifdef BATCHED_BIG_UNMAP
+#warning freed large object mappings are unmapped in batches
+// Mappings queued for unmapping at most, and the bytes after which they are
+// unmapped as a batch (or at the latest, after BIG_UNMAP_DELAY_MS).
+#define BIG_UNMAP_QUEUE_SIZE 64
+#define BIG_UNMAP_BATCH_BYTES 0x4000000	// 64MB
+#define BIG_UNMAP_DELAY_MS 10
+// Past this, the freeing thread unmaps the queued mappings itself.
+#define BIG_UNMAP_MAX_BYTES 0x10000000	// 256MB
+#endif
+
+// Batch allocations pick a new random bag set for every run of this many
+// objects; batch frees check this many objects before listing them.
+#define BATCH_ALLOC_RUN 16
+#define BATCH_FREE_WINDOW 64
+
+// Arenas take chunks of this size from the big heap unless told otherwise,
+// and align every object to ARENA_ALIGNMENT.
+#define ARENA_CHUNK_SIZE 0x40000	// 256KB
+#define ARENA_ALIGNMENT 16
+
+#ifdef THREAD_MAGAZINE
+#warning per-thread magazines in use
+// Number of free objects each thread caches per size class.
+#ifndef MAGAZINE_DEPTH
+#define MAGAZINE_DEPTH 16
+#endif
+// Larger classes bypass the magazines, so that a refill never reserves a
+// sizable amount of memory.
+#define MAGAZINE_MAX_CLASS_SIZE 4096
+#endif
+
+#ifdef RELEASE_FREE_PAGES
+#warning fully-free BiBOP pages are returned to the OS
+// Number of empty pages (or page-sized and larger objects) a thread collects
+// before it releases them all at once.
+#define PAGE_RELEASE_BATCH 32
+#define PAGE_RELEASE_ADVICE MADV_DONTNEED
+// Layout of the per-page occupancy counters: the low bits count the live
+// objects touching the page, the high bits record its release state.
+// PAGE_RELEASED stays set from a release until the page is next occupied.
+#define PAGE_COUNT_MASK 0x1FFF
+#define PAGE_RELEASED 0x2000
+#define PAGE_QUEUED 0x4000
+#define PAGE_RELEASING 0x8000
+#endif
 
 #ifdef CUSTOMIZED_STACK
 #define STACK_SIZE  		0x800000	// 8M, PageSize * N
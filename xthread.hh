@@ -34,17 +34,18 @@
 #include "hashfuncs.hh"
 #include "hashheapallocator.hh"
 #include "log.hh"
+#include "mm.hh"
 #include "real.hh"
 #include "threadstruct.hh"
 #include "xdefines.hh"
-#ifdef SSE2RNG
-#include "sse2rng.h"
-#endif
 
 #ifdef CUSTOMIZED_STACK
 extern intptr_t globalStackAddr;
 #endif
 
+// Releases the per-thread state of the heap; run by each thread as it exits.
+void heapThreadExit();
+
 class xthread {
 
 	public:
@@ -62,19 +63,8 @@ class xthread {
 		// Initialize the spin_lock
 		pthread_spin_init(&_spin_lock, PTHREAD_PROCESS_PRIVATE);
 
-    thread_t * thread;
-
-    // Shared the threads information.
-    memset(&_threads, 0, sizeof(_threads));
-
-		// Initialize all 
-    for(int i = 0; i < MAX_ALIVE_THREADS; i++) {
-      thread = &_threads[i];
-
-			// Those information that are only initialized once.
-     	thread->available = true;
-			thread->index = i;
-	 }
+		// The entries start out zeroed, and each is set up once it is first
+		// handed out by allocThreadIndex, so that unused ones are never touched.
 
 		// Now we will intialize the initial thread
 		initializeInitialThread();
@@ -102,11 +92,22 @@ class xthread {
 	// particularily by its parent (except the initial thread)
 	inline void threadInitBeforeCreation(thread_t * thread) {
     pthread_spin_init(&thread->spinlock, 0);
+
+		#ifdef CUSTOMIZED_STACK
+		// Set guard pages at both ends of the thread's stack when its index is used
+		// for the first time; the initial thread does not run on this area.
+		if(thread->index != 0) {
+			intptr_t stackStart = globalStackAddr + (intptr_t)thread->index * STACK_SIZE;
+			if(0 != MM::guardInstall((void*)(stackStart + STACK_SIZE - GUARD_PAGE_SIZE), GUARD_PAGE_SIZE, 1, true)
+					|| 0 != MM::guardInstall((void*)stackStart, GUARD_PAGE_SIZE, 1, true)) {
+				FATAL("Failed to set guard pages for thread#%d", thread->index);
+			}
+		}
+		#endif
   }
 
 	// This function is only called in the current thread before the real thread function 
 	void initializeCurrentThread(thread_t * thread) {
-		SRAND(time(NULL));
 		thread->tid = syscall(__NR_gettid);
 		#ifndef CUSTOMIZED_STACK
 		setThreadIndex(thread->index);
@@ -114,31 +115,51 @@ class xthread {
 	}
 
 	/// @ internal function: allocation a thread index when spawning.
-  /// Since we guarantee that only one thread can be in spawning phase,
-  /// there is no need to acqurie the lock in this function.
+  /// The caller must hold the global lock. Entries released by earlier
+  /// threads are preferred, as their bags have already been used.
   int allocThreadIndex() {
     int index = -1;
 
     thread_t* thread;
-		if(_aliveThreads++ == _threadIndex) {
-			index = _threadIndex++;
-      thread = getThread(index);
-			thread->available = false;
-			threadInitBeforeCreation(thread);
-		} else {
-			for(int i = 0; i <= _threadIndex; i++) {
-      	thread = getThread(i);
-      	if(thread->available) {
-        	thread->available = false;
-					index = i;
-					//threadInitBeforeCreation(thread);
-					break;
-				}
+		for(int i = 0; i < _threadIndex; i++) {
+			thread = getThread(i);
+			if(thread->available || isReclaimable(thread)) {
+				index = i;
+				break;
+			}
+		}
+
+		if(index == -1) {
+			if(_threadIndex == _totalThreads) {
+				return -1;
 			}
+			index = _threadIndex++;
+			getThread(index)->index = index;
+			threadInitBeforeCreation(getThread(index));
 		}
+
+		_aliveThreads++;
+		thread = getThread(index);
+		thread->available = false;
+		thread->created = false;
+		thread->detached = false;
+		thread->exited = false;
+		thread->tid = 0;
     return index;
   }
 
+	// A detached thread releases its entry on exit, but its stack (which holds
+	// glibc's thread descriptor when CUSTOMIZED_STACK is used) stays in use until
+	// the kernel has finished with the thread; so does its thread index, as it
+	// may still free objects from TLS destructors. The initial thread's entry
+	// is never recycled.
+	inline bool isReclaimable(thread_t * thread) {
+		if(thread->index == 0 || !thread->created || !thread->detached || !thread->exited) {
+			return false;
+		}
+		return (syscall(__NR_tgkill, getpid(), thread->tid, 0) == -1 && errno == ESRCH);
+	}
+
 	inline void spin_lock(thread_t * thread) {
 		pthread_spin_lock(&thread->spinlock);
 	} 
@@ -157,12 +178,23 @@ class xthread {
 		int tindex = allocThreadIndex();
 		releaseGlobalLock();
 
+		if(tindex == -1) {
+			PRERR("Cannot create more than %d alive threads", _totalThreads);
+			return EAGAIN;
+		}
+
 		// Acquire the thread structure.
 		thread_t* children = getThread(tindex);	
 		children->startArg = arg;
 		children->startRoutine = fn;
 		children->index = tindex;
 
+		int detachState = PTHREAD_CREATE_JOINABLE;
+		if(attr != NULL) {
+			pthread_attr_getdetachstate(attr, &detachState);
+		}
+		children->detached = (detachState == PTHREAD_CREATE_DETACHED);
+
 		#ifdef CUSTOMIZED_STACK
 		pthread_attr_t iattr;
 		if(attr == NULL) {
@@ -171,13 +203,6 @@ class xthread {
 			memcpy(&iattr, attr, sizeof(pthread_attr_t));
 		}
 		pthread_attr_setstack(&iattr, (void*)(globalStackAddr + (intptr_t)tindex * STACK_SIZE + GUARD_PAGE_SIZE), STACK_SIZE - 2 * GUARD_PAGE_SIZE);
-		/* Guard pages have already been setted before main()
-		if(0 != mprotect((void*)(childrenStackStart + STACK_SIZE - GUARD_PAGE_SIZE), GUARD_PAGE_SIZE, PROT_NONE)
-				|| 0 != mprotect((void*)childrenStackStart, GUARD_PAGE_SIZE, PROT_NONE)) {
-			fprintf(stderr, "Failed to set guard page for thread#%d\n", tindex);
-			abort();
-		}
-		*/
 
 		int result = Real::pthread_create(tid, &iattr, xthread::startThread, (void *)children);
 		#else
@@ -191,9 +216,16 @@ class xthread {
 		// Setting up this in the main thread so that
 		// pthread_join can always find its pthread_t. 
 		// Otherwise, it can fail because the child have set this value.
-		children->pthreadt = *tid;
+		// The entry cannot be recycled before it is marked as created.
 		acquireGlobalLock();
-		_xmap.insertIfAbsent((void*)*tid, sizeof(void*), tindex);
+		children->pthreadt = *tid;
+		// A pthread_t may be handed out again once its thread is gone.
+		int oldIndex;
+		if(_xmap.find((void*)*tid, sizeof(void*), &oldIndex)) {
+			_xmap.erase((void*)*tid, sizeof(void*));
+		}
+		_xmap.insert((void*)*tid, sizeof(void*), tindex);
+		children->created = true;
 		releaseGlobalLock();
 		return result;
 	}
@@ -214,9 +246,55 @@ class xthread {
       }
     }
 
+    xthread::getInstance().threadExit(current);
  	  return result;
   }
 
+	// Run by each thread as it finishes, either by returning from its start
+	// routine or by calling pthread_exit.
+	void threadExit(thread_t * thread) {
+		heapThreadExit();
+
+		acquireGlobalLock();
+		thread->exited = true;
+		if(thread->detached && thread->index != 0) {
+			_aliveThreads--;
+		}
+		releaseGlobalLock();
+	}
+
+	void thread_exit(void * retval) {
+		#ifdef CUSTOMIZED_STACK
+		thread_t * current = getThread(getThreadIndex(&retval));
+		#else
+		thread_t * current = getThread();
+		#endif
+		// Threads not created through thread_create() fall back to the initial
+		// thread's index, whose per-thread heap state is not theirs to release.
+		if(current->tid == syscall(__NR_gettid)) {
+			threadExit(current);
+		}
+		Real::pthread_exit(retval);
+	}
+
+	int thread_detach(pthread_t tid) {
+		int result = Real::pthread_detach(tid);
+		if(result == 0) {
+			int index;
+			acquireGlobalLock();
+			if(_xmap.find((void *)tid, sizeof(void *), &index) && _threads[index].pthreadt == tid) {
+				thread_t * thread = &_threads[index];
+				// An exited thread is no longer counted once detached.
+				if(thread->exited && !thread->detached && index != 0) {
+					_aliveThreads--;
+				}
+				thread->detached = true;
+			}
+			releaseGlobalLock();
+		}
+		return result;
+	}
+
 	int thread_join(pthread_t tid, void ** retval) {
 		int joinretval;
 		if((joinretval = Real::pthread_join(tid, retval)) == 0) {
@@ -225,10 +303,10 @@ class xthread {
 				acquireGlobalLock();
 				if(!_xmap.find((void *)tid, sizeof(void *), &joinee)) {
 						PRERR("Cannot find joinee index for thread %p", (void *)tid);
-				} else {
+				} else if(_threads[joinee].pthreadt == tid && !_threads[joinee].available) {
 						_threads[joinee].available = true;
+						_aliveThreads--;
 				}
-				_aliveThreads--;
 				releaseGlobalLock();
 		}
 		return joinretval;